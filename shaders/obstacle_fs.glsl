@@ -0,0 +1,15 @@
+#version 440 core
+
+in vec2 sdf_coord;
+
+// The field the integrate pass samples, x: signed distance to the nearest solid.
+layout(binding = 1) uniform sampler2D boundary_sdf;
+
+out vec4 color_out;
+
+void main(void)
+{
+	if (texture(boundary_sdf, sdf_coord).x > 0.0)
+		discard;
+	color_out = vec4(0.45, 0.45, 0.5, 1.0);
+}
@@ -0,0 +1,11 @@
+#version 440 core
+
+out vec2 sdf_coord;
+
+// A single triangle covering the window, no vertex buffer needed.
+void main(void)
+{
+	vec2 corner = vec2(float((gl_VertexID << 1) & 2), float(gl_VertexID & 2));
+	sdf_coord = corner;
+	gl_Position = vec4(2.0 * corner - 1.0, 1.0, 1.0);
+}
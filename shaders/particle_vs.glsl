@@ -2,13 +2,39 @@
 
 in vec2 position;
 
-uniform vec2 boundary_size;
+// Solver parameters, uploaded by sph_sim only when they change.
+// The layout must match solver_params in sph_sim.h.
+layout(std140, binding = 0) uniform SolverParams
+{
+	vec2 G;					// external (gravitational) forces
+	vec2 boundary_size;
+	ivec2 grid_size;		// uniform grid cells, H wide
+	float H;				// kernel radius
+	float HSQ;				// radius^2
+	float REST_DENS;
+	float GAS_CONST;
+	float MASS;
+	float VISC;
+	float DT;
+	float POLY6;
+	float SPIKY_GRAD;
+	float VISC_LAP;
+	float EPS;				// boundary epsilon
+	float BOUND_DAMPING;
+};
+
+// Particles removed by a sink keep their slot until it is reused or compacted.
+layout(std430, binding = 4) readonly buffer ActiveBuffer
+{
+	int is_active[];
+};
 
 void main(void)
 {
 	float norm_x = (float(position.x) / (boundary_size.x / 2.0)) - 1.0;
 	float norm_y = (float(position.y) / (boundary_size.y / 2.0)) - 1.0;
 
-	gl_Position = vec4(norm_x, norm_y, 1.0, 1.0);
+	// removed particles are placed outside the clip volume
+	gl_Position = is_active[gl_VertexID] != 0 ? vec4(norm_x, norm_y, 1.0, 1.0) : vec4(2.0, 2.0, 2.0, 1.0);
 	gl_PointSize = 10;
 }
@@ -0,0 +1,89 @@
+#version 440 core
+
+// Live particle count, maintained on the GPU next to the indirect dispatch arguments.
+layout(std430, binding = 14) readonly buffer DispatchBuffer
+{
+	uint dispatch_num_groups[3];
+	uint particle_count;
+};
+
+// Current particle state.
+layout(std430, binding = 0) readonly buffer PositionBuffer
+{
+	vec2 positions[];
+};
+
+layout(std430, binding = 1) readonly buffer VelocityBuffer
+{
+	vec2 velocities[];
+};
+
+layout(std430, binding = 2) readonly buffer ForceBuffer
+{
+	vec2 forces[];
+};
+
+layout(std430, binding = 3) readonly buffer DensityPressureBuffer
+{
+	vec2 density_pressure[];	// x: density, y: pressure
+};
+
+layout(std430, binding = 4) readonly buffer ActiveBuffer
+{
+	int is_active[];
+};
+
+// Exclusive prefix sum of the active flags, i.e. the packed slot of each active particle.
+layout(std430, binding = 8) readonly buffer CompactOffsetBuffer
+{
+	uint compact_offset[];
+};
+
+// Packed particle state, swapped with the current state afterwards.
+layout(std430, binding = 9) writeonly buffer PackedPositionBuffer
+{
+	vec2 packed_positions[];
+};
+
+layout(std430, binding = 10) writeonly buffer PackedVelocityBuffer
+{
+	vec2 packed_velocities[];
+};
+
+layout(std430, binding = 11) writeonly buffer PackedForceBuffer
+{
+	vec2 packed_forces[];
+};
+
+layout(std430, binding = 12) writeonly buffer PackedDensityPressureBuffer
+{
+	vec2 packed_density_pressure[];
+};
+
+layout(std430, binding = 13) writeonly buffer PackedActiveBuffer
+{
+	int packed_is_active[];
+};
+
+// Declare the group size, LOCAL_SIZE is injected by sph_sim.
+#ifndef LOCAL_SIZE
+#define LOCAL_SIZE 128
+#endif
+layout (local_size_x = LOCAL_SIZE, local_size_y = 1, local_size_z = 1) in;
+
+void main()
+{
+	uint index = gl_GlobalInvocationID.x;
+	if (index >= particle_count)
+		return;
+
+	if (is_active[index] == 0)
+		return;
+
+	uint dst = compact_offset[index];
+	packed_positions[dst] = positions[index];
+	packed_velocities[dst] = velocities[index];
+	packed_forces[dst] = forces[index];
+	packed_density_pressure[dst] = density_pressure[index];
+	packed_is_active[dst] = 1;
+}
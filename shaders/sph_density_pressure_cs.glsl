@@ -1,65 +1,202 @@
 #version 440 core
 
-uniform float H;
-uniform float REST_DENS;
-uniform float GAS_CONST;
-uniform float MASS;
-uniform float POLY6;
+// Solver parameters, uploaded by sph_sim only when they change.
+// The layout must match solver_params in sph_sim.h.
+layout(std140, binding = 0) uniform SolverParams
+{
+	vec2 G;					// external (gravitational) forces
+	vec2 boundary_size;
+	ivec2 grid_size;		// uniform grid cells, H wide
+	float H;				// kernel radius
+	float HSQ;				// radius^2
+	float REST_DENS;
+	float GAS_CONST;
+	float MASS;
+	float VISC;
+	float DT;
+	float POLY6;
+	float SPIKY_GRAD;
+	float VISC_LAP;
+	float EPS;				// boundary epsilon
+	float BOUND_DAMPING;
+};
+
+#ifdef SPECIALIZED
+// Literals injected by sph_sim replace the constant block members from here on.
+#define H SPECIALIZED_H
+#define HSQ SPECIALIZED_HSQ
+#define MASS SPECIALIZED_MASS
+#define POLY6 SPECIALIZED_POLY6
+#define SPIKY_GRAD SPECIALIZED_SPIKY_GRAD
+#define VISC_LAP SPECIALIZED_VISC_LAP
+#define REST_DENS SPECIALIZED_REST_DENS
+#define GAS_CONST SPECIALIZED_GAS_CONST
+#endif
+
+// Live particle count, maintained on the GPU next to the indirect dispatch arguments.
+layout(std430, binding = 14) readonly buffer DispatchBuffer
+{
+	uint dispatch_num_groups[3];
+	uint particle_count;
+};
+
+// Particle state is stored as one buffer per field.
+layout(std430, binding = 0) readonly buffer PositionBuffer
+{
+	vec2 positions[];
+};
+
+#ifdef SLEEPING
+layout(std430, binding = 1) readonly buffer VelocityBuffer
+{
+	vec2 velocities[];
+};
+#endif
 
-struct Particle
+// Read back as the previous density when sleeping is enabled.
+layout(std430, binding = 3) buffer DensityPressureBuffer
 {
-	vec2 x;		// position
-	vec2 v;		// velocity
-	vec2 f;		// force
-	float rho;	// density
-	float p;	// pressure
-	int is_active;
-	int pad;
+	vec2 density_pressure[];	// x: density, y: pressure
 };
 
-// Bind the particle buffer to index 0.
-layout(std430, binding = 0) buffer ParticleBuffer
+layout(std430, binding = 4) readonly buffer ActiveBuffer
 {
-	Particle particles[];
+	int is_active[];
 };
 
-// Declare the group size.
-layout (local_size_x = 1, local_size_y = 1, local_size_z = 1) in;
+#ifdef NEIGHBOUR_GRID
+// Exclusive prefix sum of the cell counts, one extra entry holds the total.
+layout(std430, binding = 5) readonly buffer CellStartBuffer
+{
+	uint cell_start[];
+};
+
+// Particle indices ordered by cell.
+layout(std430, binding = 7) readonly buffer SortedIndexBuffer
+{
+	uint sorted_index[];
+};
+#endif
+
+#ifdef SLEEPING
+// Cell and rank of each particle from the grid build.
+layout(std430, binding = 6) readonly buffer ParticleCellBuffer
+{
+	uvec2 particle_cell[];
+};
+
+// x: steps the cell has been calm, asleep from SLEEP_STEPS on, y: disturbed this step.
+layout(std430, binding = 21) buffer CellSleepBuffer
+{
+	uvec2 cell_sleep[];
+};
+#endif
+
+// Declare the group size, LOCAL_SIZE is injected by sph_sim.
+#ifndef LOCAL_SIZE
+#define LOCAL_SIZE 128
+#endif
+layout (local_size_x = LOCAL_SIZE, local_size_y = 1, local_size_z = 1) in;
+
+#ifdef NEIGHBOUR_TILED
+// One tile of neighbour positions, loaded cooperatively by the workgroup.
+shared vec2 tile_x[LOCAL_SIZE];
+shared int tile_is_active[LOCAL_SIZE];
+#endif
 
 float squared_norm(vec2 v)
 {
 	return v.x * v.x + v.y * v.y;
 }
 
-void main()
+float density_contribution(vec2 rij)
 {
-	const float M_PI = 3.1415926535897932384626433832795;
-	const float HSQ = H*H; // radius^2 for optimization
+	float r2 = squared_norm(rij);
 
+	// this computation is symmetric
+	if (r2 >= HSQ)
+		return 0.0;
+#ifdef SPECIALIZED
+	float d = HSQ - r2;
+	return MASS*POLY6*d*d*d;
+#else
+	return MASS*POLY6*pow(HSQ - r2, 3.0);
+#endif
+}
+
+void main()
+{
 	uint index = gl_GlobalInvocationID.x;
-	uint particle_count = gl_NumWorkGroups.x;
 
-	Particle pi = particles[index];
+	float rho = 0.0;
+#ifdef NEIGHBOUR_TILED
+	// Every invocation has to reach the barriers, out of range ones only help load tiles.
+	uint self = min(index, particle_count - 1);
+	vec2 xi = positions[self];
+	bool self_active = index < particle_count && is_active[self] != 0;
+
+	for (uint tile = 0; tile < particle_count; tile += LOCAL_SIZE)
+	{
+		uint j = tile + gl_LocalInvocationID.x;
+		if (j < particle_count)
+		{
+			tile_x[gl_LocalInvocationID.x] = positions[j];
+			tile_is_active[gl_LocalInvocationID.x] = is_active[j];
+		}
+		barrier();
+
+		if (self_active)
+		{
+			uint tile_end = min(LOCAL_SIZE, particle_count - tile);
+			for (uint k = 0; k < tile_end; k++)
+				if (tile_is_active[k] != 0)
+					rho += density_contribution(tile_x[k] - xi);
+		}
+		barrier();
+	}
 
-	if (pi.is_active == 0)
+	if (!self_active)
+		return;
+#else
+	if (index >= particle_count)
 		return;
 
-	pi.rho = 0.0;
-	for (int i = 0; i < particle_count; i++)
-	{
-		if (particles[i].is_active == 0)
-			continue;
+	if (is_active[index] == 0)
+		return;
 
-		vec2 rij = particles[i].x - pi.x;
-		float r2 = squared_norm(rij);
+#ifdef SLEEPING
+	// Sleeping particles keep their last density, neighbours still read it.
+	if (cell_sleep[particle_cell[index].x].x >= SLEEP_STEPS)
+		return;
+#endif
 
-		if (r2 < HSQ)
+	vec2 xi = positions[index];
+#ifdef NEIGHBOUR_GRID
+	ivec2 cell = clamp(ivec2(xi / H), ivec2(0), grid_size - 1);
+	for (int cy = max(cell.y - 1, 0); cy <= min(cell.y + 1, grid_size.y - 1); cy++)
+		for (int cx = max(cell.x - 1, 0); cx <= min(cell.x + 1, grid_size.x - 1); cx++)
 		{
-			// this computation is symmetric
-			pi.rho += MASS*POLY6*pow(HSQ - r2, 3.0);
+			uint cell_index = uint(cy * grid_size.x + cx);
+			for (uint j = cell_start[cell_index]; j < cell_start[cell_index + 1]; j++)
+				rho += density_contribution(positions[sorted_index[j]] - xi);
 		}
-	}
-	pi.p = GAS_CONST*(pi.rho - REST_DENS);
+#else
+	for (uint i = 0; i < particle_count; i++)
+		if (is_active[i] != 0)
+			rho += density_contribution(positions[i] - xi);
+#endif
+#endif
+#ifdef SLEEPING
+	// A particle that still moves or compresses keeps its own and the
+	// surrounding cells awake, which also wakes fluid it is about to reach.
+	float old_rho = density_pressure[index].x;
+	if (length(velocities[index]) > SLEEP_SPEED || abs(rho - old_rho) > SLEEP_DENSITY_CHANGE * old_rho)
+		for (int cy = max(cell.y - 1, 0); cy <= min(cell.y + 1, grid_size.y - 1); cy++)
+			for (int cx = max(cell.x - 1, 0); cx <= min(cell.x + 1, grid_size.x - 1); cx++)
+				cell_sleep[cy * grid_size.x + cx].y = 1;
+#endif
 
-	particles[index] = pi;
-}
\ No newline at end of file
+	float p = GAS_CONST*(rho - REST_DENS);
+
+	density_pressure[index] = vec2(rho, p);
+}
@@ -0,0 +1,232 @@
+#version 440 core
+
+uniform uint max_particles;
+
+// Solver parameters, uploaded by sph_sim only when they change.
+// The layout must match solver_params in sph_sim.h.
+layout(std140, binding = 0) uniform SolverParams
+{
+	vec2 G;					// external (gravitational) forces
+	vec2 boundary_size;
+	ivec2 grid_size;		// uniform grid cells, H wide
+	float H;				// kernel radius
+	float HSQ;				// radius^2
+	float REST_DENS;
+	float GAS_CONST;
+	float MASS;
+	float VISC;
+	float DT;
+	float POLY6;
+	float SPIKY_GRAD;
+	float VISC_LAP;
+	float EPS;				// boundary epsilon
+	float BOUND_DAMPING;
+};
+
+// Live particle count, new particles are appended after it. Every new
+// particle takes its slot from spawned_count, sph_update_dispatch_cs.glsl
+// then adds them to the count.
+layout(std430, binding = 14) buffer DispatchBuffer
+{
+	uint dispatch_num_groups[3];
+	uint particle_count;
+	uint draw_count;
+	uint draw_instance_count;
+	uint draw_first;
+	uint draw_base_instance;
+	uint spawned_count;
+	uint free_count;
+};
+
+// Particle state is stored as one buffer per field.
+layout(std430, binding = 0) writeonly buffer PositionBuffer
+{
+	vec2 positions[];
+};
+
+layout(std430, binding = 1) writeonly buffer VelocityBuffer
+{
+	vec2 velocities[];
+};
+
+layout(std430, binding = 2) writeonly buffer ForceBuffer
+{
+	vec2 forces[];
+};
+
+layout(std430, binding = 3) writeonly buffer DensityPressureBuffer
+{
+	vec2 density_pressure[];	// x: density, y: pressure
+};
+
+layout(std430, binding = 4) writeonly buffer ActiveBuffer
+{
+	int is_active[];
+};
+
+// Slots of particles removed by sinks, reused before the live range grows.
+layout(std430, binding = 26) readonly buffer FreeSlotBuffer
+{
+	uint free_slots[];
+};
+
+// The layout must match emitter_state in sph_sim.h.
+struct Emitter
+{
+	int shape;			// emitter_shape
+	uint columns;		// lattice size, a nozzle has a single row
+	uint rows;
+	uint seed;			// of the jitter hash
+	vec2 origin;
+	vec2 size;
+	vec2 velocity;
+	float spacing;
+	float jitter;
+	float rate;			// nozzle particles per second
+	float owed;			// nozzle particles carried over to the next step
+	uint emitted;		// nozzle particles so far
+	uint padding;
+};
+
+const int EMITTER_BOX = 0;
+const int EMITTER_DISC = 1;
+const int EMITTER_NOZZLE = 2;
+
+// A single box or disc emitter, or every nozzle.
+layout(std430, binding = 15) buffer EmitterBuffer
+{
+	Emitter emitters[];
+};
+
+#ifdef NOZZLE
+// Time step of the step just taken, nozzles emit what it owes them.
+layout(std430, binding = 20) readonly buffer TimestepBuffer
+{
+	float dt;
+};
+#endif
+
+// Signed distance to the nearest wall or obstacle, no particle is spawned inside one.
+layout(binding = 1) uniform sampler2D boundary_sdf;
+
+#ifdef SLEEPING
+// x: steps the cell has been calm, asleep from SLEEP_STEPS on, y: disturbed this step.
+layout(std430, binding = 21) buffer CellSleepBuffer
+{
+	uvec2 cell_sleep[];
+};
+#endif
+
+// Declare the group size, LOCAL_SIZE is injected by sph_sim.
+#ifndef LOCAL_SIZE
+#define LOCAL_SIZE 128
+#endif
+layout (local_size_x = LOCAL_SIZE, local_size_y = 1, local_size_z = 1) in;
+
+uint hash(uint x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+// Offset of up to jitter along each axis, fixed by the seed and the particle's number.
+vec2 jitter_offset(Emitter e, uint n)
+{
+	uint h = hash(e.seed ^ hash(n));
+	return vec2(h & 0xffffu, h >> 16) / 65536.0 * e.jitter;
+}
+
+// Pops a free slot if there is one, or else appends past the live count. A
+// pop that finds the list empty, or emptied by the others, puts the count back.
+uint allocate_slot()
+{
+	int available = int(atomicAdd(free_count, 0xffffffffu));
+	if (available > 0)
+		return free_slots[available - 1];
+
+	atomicAdd(free_count, 1u);
+	return particle_count + atomicAdd(spawned_count, 1u);
+}
+
+void emit_particle(vec2 x, vec2 v)
+{
+	if (textureLod(boundary_sdf, x / boundary_size, 0.0).x < 0.5 * EPS)
+		return;
+
+	uint slot = allocate_slot();
+	if (slot >= max_particles)
+		return;
+
+	positions[slot] = x;
+	velocities[slot] = v;
+	forces[slot] = vec2(0.0, 0.0);
+	density_pressure[slot] = vec2(0.0, 0.0);
+	is_active[slot] = 1;
+
+#ifdef SLEEPING
+	// New particles have no density yet, wake their block of cells before the next step.
+	ivec2 cell = clamp(ivec2(x / H), ivec2(0), grid_size - 1);
+	for (int cy = max(cell.y - 1, 0); cy <= min(cell.y + 1, grid_size.y - 1); cy++)
+		for (int cx = max(cell.x - 1, 0); cx <= min(cell.x + 1, grid_size.x - 1); cx++)
+			cell_sleep[cy * grid_size.x + cx] = uvec2(0, 1);
+#endif
+}
+
+#ifdef NOZZLE
+shared uint emit_count;
+shared uint first_emitted;
+
+// One workgroup per nozzle. Particles leave the opening a row at a time,
+// each spread along the distance the fluid has moved since it was due.
+void main()
+{
+	uint nozzle = gl_WorkGroupID.x;
+	Emitter e = emitters[nozzle];
+	if (gl_LocalInvocationIndex == 0)
+	{
+		float owed = e.owed + e.rate * dt;
+		emit_count = uint(owed);
+		first_emitted = e.emitted;
+		emitters[nozzle].owed = owed - float(emit_count);
+		emitters[nozzle].emitted = e.emitted + emit_count;
+	}
+	barrier();
+
+	vec2 along = normalize(e.velocity);
+	vec2 across = vec2(-along.y, along.x);
+	for (uint i = gl_LocalInvocationIndex; i < emit_count; i += LOCAL_SIZE)
+	{
+		uint n = first_emitted + i;
+		float column = float(n % e.columns) - 0.5 * float(e.columns - 1);
+		float travelled = length(e.velocity) * dt * (1.0 - (float(i) + 0.5) / float(emit_count));
+		emit_particle(e.origin + column * e.spacing * across + travelled * along + jitter_offset(e, n), e.velocity);
+	}
+}
+#else
+// One invocation per lattice point of the box or disc.
+void main()
+{
+	uint n = gl_GlobalInvocationID.x;
+	Emitter e = emitters[0];
+	if (n >= e.columns * e.rows)
+		return;
+
+	vec2 lattice = vec2(n % e.columns, n / e.columns) * e.spacing;
+	vec2 x;
+	if (e.shape == EMITTER_DISC)
+	{
+		// the lattice covers the disc's bounding square, centred on it
+		x = e.origin + lattice - 0.5 * float(e.columns - 1) * e.spacing;
+		if (length(x - e.origin) > e.size.x)
+			return;
+	}
+	else
+		x = e.origin + lattice;
+
+	emit_particle(x + jitter_offset(e, n), e.velocity);
+}
+#endif
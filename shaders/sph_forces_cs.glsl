@@ -1,69 +1,212 @@
 #version 440 core
 
-uniform vec2 G;
-uniform float H;
-uniform float MASS;
-uniform float VISC;
-uniform float SPIKY_GRAD;
-uniform float VISC_LAP;
-
-struct Particle
+// Solver parameters, uploaded by sph_sim only when they change.
+// The layout must match solver_params in sph_sim.h.
+layout(std140, binding = 0) uniform SolverParams
 {
-	vec2 x;		// position
-	vec2 v;		// velocity
-	vec2 f;		// force
-	float rho;	// density
-	float p;	// pressure
-	int is_active;
-	int pad;
+	vec2 G;					// external (gravitational) forces
+	vec2 boundary_size;
+	ivec2 grid_size;		// uniform grid cells, H wide
+	float H;				// kernel radius
+	float HSQ;				// radius^2
+	float REST_DENS;
+	float GAS_CONST;
+	float MASS;
+	float VISC;
+	float DT;
+	float POLY6;
+	float SPIKY_GRAD;
+	float VISC_LAP;
+	float EPS;				// boundary epsilon
+	float BOUND_DAMPING;
 };
 
-// Bind the particle buffer to index 0.
-layout(std430, binding = 0) buffer ParticleBuffer
+#ifdef SPECIALIZED
+// Literals injected by sph_sim replace the constant block members from here on.
+#define H SPECIALIZED_H
+#define HSQ SPECIALIZED_HSQ
+#define MASS SPECIALIZED_MASS
+#define POLY6 SPECIALIZED_POLY6
+#define SPIKY_GRAD SPECIALIZED_SPIKY_GRAD
+#define VISC_LAP SPECIALIZED_VISC_LAP
+#define REST_DENS SPECIALIZED_REST_DENS
+#define GAS_CONST SPECIALIZED_GAS_CONST
+#endif
+
+// Live particle count, maintained on the GPU next to the indirect dispatch arguments.
+layout(std430, binding = 14) readonly buffer DispatchBuffer
+{
+	uint dispatch_num_groups[3];
+	uint particle_count;
+};
+
+// Particle state is stored as one buffer per field.
+layout(std430, binding = 0) readonly buffer PositionBuffer
+{
+	vec2 positions[];
+};
+
+layout(std430, binding = 1) readonly buffer VelocityBuffer
+{
+	vec2 velocities[];
+};
+
+layout(std430, binding = 2) writeonly buffer ForceBuffer
+{
+	vec2 forces[];
+};
+
+layout(std430, binding = 3) readonly buffer DensityPressureBuffer
+{
+	vec2 density_pressure[];	// x: density, y: pressure
+};
+
+layout(std430, binding = 4) readonly buffer ActiveBuffer
+{
+	int is_active[];
+};
+
+#ifdef NEIGHBOUR_GRID
+// Exclusive prefix sum of the cell counts, one extra entry holds the total.
+layout(std430, binding = 5) readonly buffer CellStartBuffer
+{
+	uint cell_start[];
+};
+
+// Particle indices ordered by cell.
+layout(std430, binding = 7) readonly buffer SortedIndexBuffer
+{
+	uint sorted_index[];
+};
+#endif
+
+#ifdef SLEEPING
+// Cell and rank of each particle from the grid build.
+layout(std430, binding = 6) readonly buffer ParticleCellBuffer
 {
-	Particle particles[];
+	uvec2 particle_cell[];
 };
 
-// Declare the group size.
-layout (local_size_x = 1, local_size_y = 1, local_size_z = 1) in;
+// x: steps the cell has been calm, asleep from SLEEP_STEPS on, y: disturbed this step.
+layout(std430, binding = 21) readonly buffer CellSleepBuffer
+{
+	uvec2 cell_sleep[];
+};
+#endif
+
+// Declare the group size, LOCAL_SIZE is injected by sph_sim.
+#ifndef LOCAL_SIZE
+#define LOCAL_SIZE 128
+#endif
+layout (local_size_x = LOCAL_SIZE, local_size_y = 1, local_size_z = 1) in;
+
+#ifdef NEIGHBOUR_TILED
+// One tile of neighbour state, loaded cooperatively by the workgroup.
+shared vec2 tile_x[LOCAL_SIZE];
+shared vec2 tile_v[LOCAL_SIZE];
+shared vec2 tile_rho_p[LOCAL_SIZE];
+shared int tile_is_active[LOCAL_SIZE];
+#endif
 
 float norm(vec2 v)
 {
 	return sqrt(v.x * v.x + v.y * v.y);
 }
 
-void main()
+// Pressure and viscosity force exerted on particle i by a neighbour j.
+vec2 force_contribution(vec2 xi, vec2 vi, float pi, vec2 xj, vec2 vj, vec2 rho_pj)
 {
-	const float M_PI = 3.1415926535897932384626433832795;
+	vec2 rij = xj - xi;
+	float r = norm(rij);
 
-	uint index = gl_GlobalInvocationID.x;
-	uint particle_count = gl_NumWorkGroups.x;
+	// r == 0 happens when the boundary clamps two particles onto the same
+	// spot, there is no direction to push them apart along.
+	if (r >= H || r == 0.0)
+		return vec2(0.0, 0.0);
 
-	Particle pi = particles[index];
+	// compute pressure force contribution
+#ifdef SPECIALIZED
+	vec2 fpress = -normalize(rij)*MASS*(pi + rho_pj.y) / (2.0 * rho_pj.x) * SPIKY_GRAD*(H - r)*(H - r);
+#else
+	vec2 fpress = -normalize(rij)*MASS*(pi + rho_pj.y) / (2.0 * rho_pj.x) * SPIKY_GRAD*pow(H - r, 2.0);
+#endif
+	// compute viscosity force contribution
+	vec2 fvisc = VISC*MASS*(vj - vi) / rho_pj.x * VISC_LAP*(H - r);
 
-	if (pi.is_active == 0)
-		return;
+	return fpress + fvisc;
+}
 
-	vec2 fpress = vec2(0.0, 0.0);
-	vec2 fvisc = vec2(0.0, 0.0);
-	for (int i = 0; i < particle_count; i++)
-	{
-		if (i == index)
-			continue;
+void main()
+{
+	uint index = gl_GlobalInvocationID.x;
 
-		vec2 rij = particles[i].x - pi.x;
-		float r = norm(rij);
+	vec2 f = vec2(0.0, 0.0);
+#ifdef NEIGHBOUR_TILED
+	// Every invocation has to reach the barriers, out of range ones only help load tiles.
+	uint self = min(index, particle_count - 1);
+	vec2 xi = positions[self];
+	vec2 vi = velocities[self];
+	vec2 rho_pi = density_pressure[self];
+	bool self_active = index < particle_count && is_active[self] != 0;
 
-		if (r < H)
+	for (uint tile = 0; tile < particle_count; tile += LOCAL_SIZE)
+	{
+		uint j = tile + gl_LocalInvocationID.x;
+		if (j < particle_count)
 		{
-			// compute pressure force contribution
-			fpress += -normalize(rij)*MASS*(pi.p + particles[i].p) / (2.0 * particles[i].rho) * SPIKY_GRAD*pow(H - r, 2.0);
-			// compute viscosity force contribution
-			fvisc += VISC*MASS*(particles[i].v - pi.v) / particles[i].rho * VISC_LAP*(H - r);
+			tile_x[gl_LocalInvocationID.x] = positions[j];
+			tile_v[gl_LocalInvocationID.x] = velocities[j];
+			tile_rho_p[gl_LocalInvocationID.x] = density_pressure[j];
+			tile_is_active[gl_LocalInvocationID.x] = is_active[j];
 		}
+		barrier();
+
+		if (self_active)
+		{
+			uint tile_end = min(LOCAL_SIZE, particle_count - tile);
+			for (uint k = 0; k < tile_end; k++)
+				if (tile + k != index && tile_is_active[k] != 0)
+					f += force_contribution(xi, vi, rho_pi.y, tile_x[k], tile_v[k], tile_rho_p[k]);
+		}
+		barrier();
 	}
-	vec2 fgrav = G * pi.rho;
-	pi.f = fpress + fvisc + fgrav;
 
-	particles[index] = pi;
+	if (!self_active)
+		return;
+#else
+	if (index >= particle_count)
+		return;
+
+	if (is_active[index] == 0)
+		return;
+
+#ifdef SLEEPING
+	if (cell_sleep[particle_cell[index].x].x >= SLEEP_STEPS)
+		return;
+#endif
+
+	vec2 xi = positions[index];
+	vec2 vi = velocities[index];
+	vec2 rho_pi = density_pressure[index];
+#ifdef NEIGHBOUR_GRID
+	ivec2 cell = clamp(ivec2(xi / H), ivec2(0), grid_size - 1);
+	for (int cy = max(cell.y - 1, 0); cy <= min(cell.y + 1, grid_size.y - 1); cy++)
+		for (int cx = max(cell.x - 1, 0); cx <= min(cell.x + 1, grid_size.x - 1); cx++)
+		{
+			uint cell_index = uint(cy * grid_size.x + cx);
+			for (uint j = cell_start[cell_index]; j < cell_start[cell_index + 1]; j++)
+			{
+				uint i = sorted_index[j];
+				if (i != index)
+					f += force_contribution(xi, vi, rho_pi.y, positions[i], velocities[i], density_pressure[i]);
+			}
+		}
+#else
+	for (uint i = 0; i < particle_count; i++)
+		if (i != index && is_active[i] != 0)
+			f += force_contribution(xi, vi, rho_pi.y, positions[i], velocities[i], density_pressure[i]);
+#endif
+#endif
+	vec2 fgrav = G * rho_pi.x;
+	forces[index] = f + fgrav;
 }
@@ -0,0 +1,87 @@
+#version 440 core
+
+// Solver parameters, uploaded by sph_sim only when they change.
+// The layout must match solver_params in sph_sim.h.
+layout(std140, binding = 0) uniform SolverParams
+{
+	vec2 G;					// external (gravitational) forces
+	vec2 boundary_size;
+	ivec2 grid_size;		// uniform grid cells, H wide
+	float H;				// kernel radius
+	float HSQ;				// radius^2
+	float REST_DENS;
+	float GAS_CONST;
+	float MASS;
+	float VISC;
+	float DT;
+	float POLY6;
+	float SPIKY_GRAD;
+	float VISC_LAP;
+	float EPS;				// boundary epsilon
+	float BOUND_DAMPING;
+};
+
+#ifdef SPECIALIZED
+// Literals injected by sph_sim replace the constant block members from here on.
+#define H SPECIALIZED_H
+#define HSQ SPECIALIZED_HSQ
+#define MASS SPECIALIZED_MASS
+#define POLY6 SPECIALIZED_POLY6
+#define SPIKY_GRAD SPECIALIZED_SPIKY_GRAD
+#define VISC_LAP SPECIALIZED_VISC_LAP
+#define REST_DENS SPECIALIZED_REST_DENS
+#define GAS_CONST SPECIALIZED_GAS_CONST
+#endif
+
+// Live particle count, maintained on the GPU next to the indirect dispatch arguments.
+layout(std430, binding = 14) readonly buffer DispatchBuffer
+{
+	uint dispatch_num_groups[3];
+	uint particle_count;
+};
+
+// Particle state is stored as one buffer per field.
+layout(std430, binding = 0) readonly buffer PositionBuffer
+{
+	vec2 positions[];
+};
+
+layout(std430, binding = 4) readonly buffer ActiveBuffer
+{
+	int is_active[];
+};
+
+// Per cell particle counts, turned into start offsets by the scan pass.
+layout(std430, binding = 5) buffer CellStartBuffer
+{
+	uint cell_start[];
+};
+
+// Cell index and rank within that cell for each particle.
+layout(std430, binding = 6) writeonly buffer ParticleCellBuffer
+{
+	uvec2 particle_cell[];
+};
+
+// Declare the group size, LOCAL_SIZE is injected by sph_sim.
+#ifndef LOCAL_SIZE
+#define LOCAL_SIZE 128
+#endif
+layout (local_size_x = LOCAL_SIZE, local_size_y = 1, local_size_z = 1) in;
+
+void main()
+{
+	uint index = gl_GlobalInvocationID.x;
+	if (index >= particle_count)
+		return;
+
+	if (is_active[index] == 0)
+		return;
+
+	// cells are H wide so all neighbours lie in the surrounding 3x3 cells
+	ivec2 cell = clamp(ivec2(positions[index] / H), ivec2(0), grid_size - 1);
+	uint cell_index = uint(cell.y * grid_size.x + cell.x);
+
+	uint rank = atomicAdd(cell_start[cell_index], 1);
+	particle_cell[index] = uvec2(cell_index, rank);
+}
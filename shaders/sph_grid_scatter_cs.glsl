@@ -0,0 +1,50 @@
+#version 440 core
+
+// Live particle count, maintained on the GPU next to the indirect dispatch arguments.
+layout(std430, binding = 14) readonly buffer DispatchBuffer
+{
+	uint dispatch_num_groups[3];
+	uint particle_count;
+};
+
+layout(std430, binding = 4) readonly buffer ActiveBuffer
+{
+	int is_active[];
+};
+
+// Exclusive prefix sum of the cell counts.
+layout(std430, binding = 5) readonly buffer CellStartBuffer
+{
+	uint cell_start[];
+};
+
+// Cell index and rank within that cell for each particle.
+layout(std430, binding = 6) readonly buffer ParticleCellBuffer
+{
+	uvec2 particle_cell[];
+};
+
+// Particle indices ordered by cell.
+layout(std430, binding = 7) writeonly buffer SortedIndexBuffer
+{
+	uint sorted_index[];
+};
+
+// Declare the group size, LOCAL_SIZE is injected by sph_sim.
+#ifndef LOCAL_SIZE
+#define LOCAL_SIZE 128
+#endif
+layout (local_size_x = LOCAL_SIZE, local_size_y = 1, local_size_z = 1) in;
+
+void main()
+{
+	uint index = gl_GlobalInvocationID.x;
+	if (index >= particle_count)
+		return;
+
+	if (is_active[index] == 0)
+		return;
+
+	uvec2 pc = particle_cell[index];
+	sorted_index[cell_start[pc.x] + pc.y] = index;
+}
@@ -1,66 +1,173 @@
 #version 440 core
 
-uniform float DT;
-uniform float H;
-uniform float BOUND_DAMPING;
-uniform vec2 boundary_size;
+// Solver parameters, uploaded by sph_sim only when they change.
+// The layout must match solver_params in sph_sim.h.
+layout(std140, binding = 0) uniform SolverParams
+{
+	vec2 G;					// external (gravitational) forces
+	vec2 boundary_size;
+	ivec2 grid_size;		// uniform grid cells, H wide
+	float H;				// kernel radius
+	float HSQ;				// radius^2
+	float REST_DENS;
+	float GAS_CONST;
+	float MASS;
+	float VISC;
+	float DT;
+	float POLY6;
+	float SPIKY_GRAD;
+	float VISC_LAP;
+	float EPS;				// boundary epsilon
+	float BOUND_DAMPING;
+};
 
-struct Particle
+// Live particle count, maintained on the GPU next to the indirect dispatch
+// arguments, and the number of slots on the free list.
+layout(std430, binding = 14) buffer DispatchBuffer
 {
-	vec2 x;		// position
-	vec2 v;		// velocity
-	vec2 f;		// force
-	float rho;	// density
-	float p;	// pressure
-	int is_active;
-	int pad;
+	uint dispatch_num_groups[3];
+	uint particle_count;
+	uint draw_count;
+	uint draw_instance_count;
+	uint draw_first;
+	uint draw_base_instance;
+	uint spawned_count;
+	uint free_count;
 };
 
-// Bind the particle buffer to index 0.
-layout(std430, binding = 0) buffer ParticleBuffer
+// Particle state is stored as one buffer per field.
+layout(std430, binding = 0) buffer PositionBuffer
 {
-	Particle particles[];
+	vec2 positions[];
 };
 
-// Declare the group size.
-layout (local_size_x = 1, local_size_y = 1, local_size_z = 1) in;
+layout(std430, binding = 1) buffer VelocityBuffer
+{
+	vec2 velocities[];
+};
 
-void main()
+layout(std430, binding = 2) readonly buffer ForceBuffer
+{
+	vec2 forces[];
+};
+
+layout(std430, binding = 3) readonly buffer DensityPressureBuffer
+{
+	vec2 density_pressure[];	// x: density, y: pressure
+};
+
+layout(std430, binding = 4) buffer ActiveBuffer
 {
-	const float EPS = H; // boundary epsilon
+	int is_active[];
+};
+
+// Slots of removed particles, for the emitters to reuse.
+layout(std430, binding = 26) writeonly buffer FreeSlotBuffer
+{
+	uint free_slots[];
+};
+
+// The layout must match sink_state in sph_sim.h.
+struct Sink
+{
+	int shape;			// emitter_shape, box or disc
+	uint padding;
+	vec2 origin;		// lower left corner or centre
+	vec2 size;			// box size, or the radius in x
+};
+
+const int SINK_BOX = 0;
+const int SINK_DISC = 1;
+
+layout(std430, binding = 27) readonly buffer SinkBuffer
+{
+	Sink sinks[];
+};
+uniform uint sink_count;
 
+#ifdef SLEEPING
+// Cell and rank of each particle from the grid build.
+layout(std430, binding = 6) readonly buffer ParticleCellBuffer
+{
+	uvec2 particle_cell[];
+};
+
+// x: steps the cell has been calm, asleep from SLEEP_STEPS on.
+layout(std430, binding = 21) readonly buffer CellSleepBuffer
+{
+	uvec2 cell_sleep[];
+};
+#endif
+
+// Signed distance to the nearest wall or obstacle in x, negative inside it,
+// and the unit normal pointing away from it in yz. Baked by sdf_boundary.
+layout(binding = 1) uniform sampler2D boundary_sdf;
+
+// Time step of this step, DT or the one chosen by sph_timestep_cs.glsl.
+layout(std430, binding = 20) readonly buffer TimestepBuffer
+{
+	float dt;
+};
+
+// Declare the group size, LOCAL_SIZE is injected by sph_sim.
+#ifndef LOCAL_SIZE
+#define LOCAL_SIZE 128
+#endif
+layout (local_size_x = LOCAL_SIZE, local_size_y = 1, local_size_z = 1) in;
+
+void main()
+{
 	uint index = gl_GlobalInvocationID.x;
+	if (index >= particle_count)
+		return;
 
-	Particle p = particles[index];
+	if (is_active[index] == 0)
+		return;
 
-	if (p.is_active == 0)
+#ifdef SLEEPING
+	// sleeping particles stay where they are
+	if (cell_sleep[particle_cell[index].x].x >= SLEEP_STEPS)
 		return;
+#endif
+
+	vec2 x = positions[index];
+	vec2 v = velocities[index];
 
 	// forward Euler integration
-	p.v += DT*p.f / p.rho;
-	p.x += DT*p.v;
+	v += dt*forces[index] / density_pressure[index].x;
+	x += dt*v;
 
 	// enforce boundary conditions
-	if (p.x.x - EPS < 0.0)
+	// Particles closer than EPS to a solid are pushed back out along its normal
+	// and their velocity into it is damped, whatever the shape of the solid.
+	vec3 sdf = textureLod(boundary_sdf, x / boundary_size, 0.0).xyz;
+	float depth = EPS - sdf.x;
+	float normal_length = length(sdf.yz);
+	if (depth > 0.0 && normal_length > 0.0)
 	{
-		p.v.x *= BOUND_DAMPING;
-		p.x.x = EPS;
+		vec2 n = sdf.yz / normal_length;
+		x += depth * n;
+		float vn = dot(v, n);
+		if (vn < 0.0)
+			v -= (1.0 - BOUND_DAMPING) * vn * n;
 	}
-	if (p.x.x + EPS > boundary_size.x)
-	{
-		p.v.x *= BOUND_DAMPING;
-		p.x.x = boundary_size.x - EPS;
-	}
-	if (p.x.y - EPS < 0.0)
-	{
-		p.v.y *= BOUND_DAMPING;
-		p.x.y = EPS;
-	}
-	if (p.x.y + EPS > boundary_size.y)
+	// the field and the grid end at the domain
+	x = clamp(x, vec2(0.0), boundary_size);
+
+	// Particles that reach a sink are removed and their slot goes on the free list.
+	for (uint i = 0; i < sink_count; i++)
 	{
-		p.v.y *= BOUND_DAMPING;
-		p.x.y = boundary_size.y - EPS;
+		vec2 offset = x - sinks[i].origin;
+		bool inside = sinks[i].shape == SINK_DISC ? dot(offset, offset) < sinks[i].size.x * sinks[i].size.x
+			: all(greaterThanEqual(offset, vec2(0.0))) && all(lessThan(offset, sinks[i].size));
+		if (inside)
+		{
+			is_active[index] = 0;
+			free_slots[atomicAdd(free_count, 1u)] = index;
+			return;
+		}
 	}
 
-	particles[index] = p;
-}
\ No newline at end of file
+	positions[index] = x;
+	velocities[index] = v;
+}
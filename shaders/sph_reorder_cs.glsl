@@ -0,0 +1,86 @@
+#version 440 core
+
+// Live particle count, maintained on the GPU next to the indirect dispatch arguments.
+layout(std430, binding = 14) readonly buffer DispatchBuffer
+{
+	uint dispatch_num_groups[3];
+	uint particle_count;
+};
+
+// Current particle state.
+layout(std430, binding = 0) readonly buffer PositionBuffer
+{
+	vec2 positions[];
+};
+
+layout(std430, binding = 1) readonly buffer VelocityBuffer
+{
+	vec2 velocities[];
+};
+
+layout(std430, binding = 2) readonly buffer ForceBuffer
+{
+	vec2 forces[];
+};
+
+layout(std430, binding = 3) readonly buffer DensityPressureBuffer
+{
+	vec2 density_pressure[];	// x: density, y: pressure
+};
+
+layout(std430, binding = 4) readonly buffer ActiveBuffer
+{
+	int is_active[];
+};
+
+// Index of the particle that moves into each slot, in Morton order.
+layout(std430, binding = 17) readonly buffer SortValueBuffer
+{
+	uint sort_values[];
+};
+
+// Reordered particle state, swapped with the current state afterwards.
+layout(std430, binding = 9) writeonly buffer PackedPositionBuffer
+{
+	vec2 packed_positions[];
+};
+
+layout(std430, binding = 10) writeonly buffer PackedVelocityBuffer
+{
+	vec2 packed_velocities[];
+};
+
+layout(std430, binding = 11) writeonly buffer PackedForceBuffer
+{
+	vec2 packed_forces[];
+};
+
+layout(std430, binding = 12) writeonly buffer PackedDensityPressureBuffer
+{
+	vec2 packed_density_pressure[];
+};
+
+layout(std430, binding = 13) writeonly buffer PackedActiveBuffer
+{
+	int packed_is_active[];
+};
+
+// Declare the group size, LOCAL_SIZE is injected by sph_sim.
+#ifndef LOCAL_SIZE
+#define LOCAL_SIZE 128
+#endif
+layout (local_size_x = LOCAL_SIZE, local_size_y = 1, local_size_z = 1) in;
+
+void main()
+{
+	uint index = gl_GlobalInvocationID.x;
+	if (index >= particle_count)
+		return;
+
+	uint src = sort_values[index];
+	packed_positions[index] = positions[src];
+	packed_velocities[index] = velocities[src];
+	packed_forces[index] = forces[src];
+	packed_density_pressure[index] = density_pressure[src];
+	packed_is_active[index] = is_active[src];
+}
@@ -0,0 +1,49 @@
+#version 440 core
+
+// Number of values to scan.
+uniform uint element_count;
+
+// Scanned in place: on exit values[i] holds the sum of all values before i.
+layout(std430, binding = 8) buffer ScanBuffer
+{
+	uint values[];
+};
+
+// The scan runs as one workgroup, each invocation owning a contiguous chunk.
+#define SCAN_GROUP_SIZE 1024
+
+layout (local_size_x = SCAN_GROUP_SIZE, local_size_y = 1, local_size_z = 1) in;
+
+shared uint chunk_sums[SCAN_GROUP_SIZE];
+
+void main()
+{
+	uint lid = gl_LocalInvocationID.x;
+	uint chunk = (element_count + SCAN_GROUP_SIZE - 1) / SCAN_GROUP_SIZE;
+	uint first = min(lid * chunk, element_count);
+	uint last = min(first + chunk, element_count);
+
+	uint sum = 0;
+	for (uint i = first; i < last; i++)
+		sum += values[i];
+
+	chunk_sums[lid] = sum;
+	barrier();
+
+	// Hillis-Steele inclusive scan of the chunk sums.
+	for (uint offset = 1; offset < SCAN_GROUP_SIZE; offset <<= 1)
+	{
+		uint add = lid >= offset ? chunk_sums[lid - offset] : 0;
+		barrier();
+		chunk_sums[lid] += add;
+		barrier();
+	}
+
+	uint running = chunk_sums[lid] - sum;
+	for (uint i = first; i < last; i++)
+	{
+		uint v = values[i];
+		values[i] = running;
+		running += v;
+	}
+}
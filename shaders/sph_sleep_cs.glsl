@@ -0,0 +1,29 @@
+#version 440 core
+
+// Number of grid cells.
+uniform uint cell_count;
+
+// x: steps the cell has been calm, asleep from SLEEP_STEPS on, y: disturbed this step.
+layout(std430, binding = 21) buffer CellSleepBuffer
+{
+	uvec2 cell_sleep[];
+};
+
+// Declare the group size, LOCAL_SIZE is injected by sph_sim.
+#ifndef LOCAL_SIZE
+#define LOCAL_SIZE 128
+#endif
+layout (local_size_x = LOCAL_SIZE, local_size_y = 1, local_size_z = 1) in;
+
+void main()
+{
+	uint index = gl_GlobalInvocationID.x;
+	if (index >= cell_count)
+		return;
+
+	// A disturbed cell wakes at once, a calm one falls asleep after SLEEP_STEPS steps.
+	uvec2 state = cell_sleep[index];
+	state.x = state.y != 0 ? 0 : min(state.x + 1, SLEEP_STEPS);
+	state.y = 0;
+	cell_sleep[index] = state;
+}
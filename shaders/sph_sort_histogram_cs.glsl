@@ -0,0 +1,48 @@
+#version 440 core
+
+// Position of the 4 bit digit sorted by this pass.
+uniform uint digit_shift;
+// Entries per digit in the histogram, the largest possible number of workgroups.
+uniform uint group_stride;
+
+// Live particle count, maintained on the GPU next to the indirect dispatch arguments.
+layout(std430, binding = 14) readonly buffer DispatchBuffer
+{
+	uint dispatch_num_groups[3];
+	uint particle_count;
+};
+
+layout(std430, binding = 16) readonly buffer SortKeyBuffer
+{
+	uint sort_keys[];
+};
+
+// Digit counts per workgroup, digit major so the scan turns them into scatter offsets.
+layout(std430, binding = 8) writeonly buffer HistogramBuffer
+{
+	uint histogram[];
+};
+
+// Declare the group size, LOCAL_SIZE is injected by sph_sim.
+#ifndef LOCAL_SIZE
+#define LOCAL_SIZE 128
+#endif
+layout (local_size_x = LOCAL_SIZE, local_size_y = 1, local_size_z = 1) in;
+
+shared uint digit_count[16];
+
+void main()
+{
+	uint index = gl_GlobalInvocationID.x;
+
+	if (gl_LocalInvocationIndex < 16)
+		digit_count[gl_LocalInvocationIndex] = 0;
+	barrier();
+
+	if (index < particle_count)
+		atomicAdd(digit_count[(sort_keys[index] >> digit_shift) & 0xfu], 1);
+	barrier();
+
+	if (gl_LocalInvocationIndex < 16)
+		histogram[gl_LocalInvocationIndex * group_stride + gl_WorkGroupID.x] = digit_count[gl_LocalInvocationIndex];
+}
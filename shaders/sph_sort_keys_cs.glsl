@@ -0,0 +1,101 @@
+#version 440 core
+
+// Bits per axis of the Morton code, enough to cover the grid.
+uniform uint morton_bits;
+
+// Solver parameters, uploaded by sph_sim only when they change.
+// The layout must match solver_params in sph_sim.h.
+layout(std140, binding = 0) uniform SolverParams
+{
+	vec2 G;					// external (gravitational) forces
+	vec2 boundary_size;
+	ivec2 grid_size;		// uniform grid cells, H wide
+	float H;				// kernel radius
+	float HSQ;				// radius^2
+	float REST_DENS;
+	float GAS_CONST;
+	float MASS;
+	float VISC;
+	float DT;
+	float POLY6;
+	float SPIKY_GRAD;
+	float VISC_LAP;
+	float EPS;				// boundary epsilon
+	float BOUND_DAMPING;
+};
+
+#ifdef SPECIALIZED
+// Literals injected by sph_sim replace the constant block members from here on.
+#define H SPECIALIZED_H
+#define HSQ SPECIALIZED_HSQ
+#define MASS SPECIALIZED_MASS
+#define POLY6 SPECIALIZED_POLY6
+#define SPIKY_GRAD SPECIALIZED_SPIKY_GRAD
+#define VISC_LAP SPECIALIZED_VISC_LAP
+#define REST_DENS SPECIALIZED_REST_DENS
+#define GAS_CONST SPECIALIZED_GAS_CONST
+#endif
+
+// Live particle count, maintained on the GPU next to the indirect dispatch arguments.
+layout(std430, binding = 14) readonly buffer DispatchBuffer
+{
+	uint dispatch_num_groups[3];
+	uint particle_count;
+};
+
+// Particle state is stored as one buffer per field.
+layout(std430, binding = 0) readonly buffer PositionBuffer
+{
+	vec2 positions[];
+};
+
+layout(std430, binding = 4) readonly buffer ActiveBuffer
+{
+	int is_active[];
+};
+
+// Sort keys and the particle index each one belongs to.
+layout(std430, binding = 18) writeonly buffer SortKeyBuffer
+{
+	uint sort_keys[];
+};
+
+layout(std430, binding = 19) writeonly buffer SortValueBuffer
+{
+	uint sort_values[];
+};
+
+// Declare the group size, LOCAL_SIZE is injected by sph_sim.
+#ifndef LOCAL_SIZE
+#define LOCAL_SIZE 128
+#endif
+layout (local_size_x = LOCAL_SIZE, local_size_y = 1, local_size_z = 1) in;
+
+// Spread the low 16 bits of v out to the even bits.
+uint part_1_by_1(uint v)
+{
+	v &= 0x0000ffffu;
+	v = (v | (v << 8)) & 0x00ff00ffu;
+	v = (v | (v << 4)) & 0x0f0f0f0fu;
+	v = (v | (v << 2)) & 0x33333333u;
+	v = (v | (v << 1)) & 0x55555555u;
+	return v;
+}
+
+void main()
+{
+	uint index = gl_GlobalInvocationID.x;
+	if (index >= particle_count)
+		return;
+
+	// Z-order of the H sized grid cells, inactive particles sort after all of them.
+	uint key = 1u << (2 * morton_bits);
+	if (is_active[index] != 0)
+	{
+		uvec2 cell = uvec2(clamp(ivec2(positions[index] / H), ivec2(0), grid_size - 1));
+		key = part_1_by_1(cell.x) | (part_1_by_1(cell.y) << 1);
+	}
+
+	sort_keys[index] = key;
+	sort_values[index] = index;
+}
@@ -0,0 +1,71 @@
+#version 440 core
+
+// Position of the 4 bit digit sorted by this pass.
+uniform uint digit_shift;
+// Entries per digit in the histogram, the largest possible number of workgroups.
+uniform uint group_stride;
+
+// Live particle count, maintained on the GPU next to the indirect dispatch arguments.
+layout(std430, binding = 14) readonly buffer DispatchBuffer
+{
+	uint dispatch_num_groups[3];
+	uint particle_count;
+};
+
+layout(std430, binding = 16) readonly buffer SortKeyBuffer
+{
+	uint sort_keys[];
+};
+
+layout(std430, binding = 17) readonly buffer SortValueBuffer
+{
+	uint sort_values[];
+};
+
+// Scanned histogram, the first output slot of each digit in each workgroup.
+layout(std430, binding = 8) readonly buffer HistogramBuffer
+{
+	uint histogram[];
+};
+
+layout(std430, binding = 18) writeonly buffer SortedKeyBuffer
+{
+	uint sorted_keys[];
+};
+
+layout(std430, binding = 19) writeonly buffer SortedValueBuffer
+{
+	uint sorted_values[];
+};
+
+// Declare the group size, LOCAL_SIZE is injected by sph_sim.
+#ifndef LOCAL_SIZE
+#define LOCAL_SIZE 128
+#endif
+layout (local_size_x = LOCAL_SIZE, local_size_y = 1, local_size_z = 1) in;
+
+shared uint local_digit[LOCAL_SIZE];
+
+void main()
+{
+	uint index = gl_GlobalInvocationID.x;
+	uint local = gl_LocalInvocationIndex;
+
+	// 16 marks an invocation past the end, it matches no real digit.
+	uint key = index < particle_count ? sort_keys[index] : 0;
+	uint digit = index < particle_count ? (key >> digit_shift) & 0xfu : 16;
+	local_digit[local] = digit;
+	barrier();
+
+	if (digit == 16)
+		return;
+
+	// Rank among the earlier keys of this workgroup with the same digit keeps the sort stable.
+	uint rank = 0;
+	for (uint i = 0; i < local; i++)
+		rank += local_digit[i] == digit ? 1 : 0;
+
+	uint dst = histogram[digit * group_stride + gl_WorkGroupID.x] + rank;
+	sorted_keys[dst] = key;
+	sorted_values[dst] = sort_values[index];
+}
@@ -0,0 +1,61 @@
+#version 440 core
+
+// Solver parameters, uploaded by sph_sim only when they change.
+// The layout must match solver_params in sph_sim.h.
+layout(std140, binding = 0) uniform SolverParams
+{
+	vec2 G;					// external (gravitational) forces
+	vec2 boundary_size;
+	ivec2 grid_size;		// uniform grid cells, H wide
+	float H;				// kernel radius
+	float HSQ;				// radius^2
+	float REST_DENS;
+	float GAS_CONST;
+	float MASS;
+	float VISC;
+	float DT;
+	float POLY6;
+	float SPIKY_GRAD;
+	float VISC_LAP;
+	float EPS;				// boundary epsilon
+	float BOUND_DAMPING;
+};
+
+// The layout must match timestep_state in sph_sim.h.
+layout(std430, binding = 20) buffer TimestepBuffer
+{
+	float dt;
+	uint max_speed_bits;
+	uint max_accel_bits;
+};
+
+// Courant number for the velocity limit and its counterpart for the acceleration limit.
+uniform float cfl_number;
+uniform float force_number;
+uniform float dt_min;
+uniform float dt_max;
+
+layout (local_size_x = 1, local_size_y = 1, local_size_z = 1) in;
+
+void main()
+{
+	float max_speed = uintBitsToFloat(max_speed_bits);
+	float max_accel = uintBitsToFloat(max_accel_bits);
+
+	// No particle may cross more than a fraction of the kernel radius in one step.
+	float next_dt = dt_max;
+	if (max_speed > 0.0)
+		next_dt = min(next_dt, cfl_number * H / max_speed);
+	if (max_accel > 0.0)
+		next_dt = min(next_dt, force_number * sqrt(H / max_accel));
+
+	// A NaN maximum fails both tests above and would leave dt at dt_max, so
+	// fall back to the smallest step instead. An infinite one already gives 0.
+	if (isnan(max_speed) || isnan(max_accel))
+		dt = dt_min;
+	else
+		dt = clamp(next_dt, dt_min, dt_max);
+
+	max_speed_bits = 0;
+	max_accel_bits = 0;
+}
@@ -0,0 +1,84 @@
+#version 440 core
+
+// Live particle count, maintained on the GPU next to the indirect dispatch arguments.
+layout(std430, binding = 14) readonly buffer DispatchBuffer
+{
+	uint dispatch_num_groups[3];
+	uint particle_count;
+};
+
+// Particle state is stored as one buffer per field.
+layout(std430, binding = 1) readonly buffer VelocityBuffer
+{
+	vec2 velocities[];
+};
+
+layout(std430, binding = 2) readonly buffer ForceBuffer
+{
+	vec2 forces[];
+};
+
+layout(std430, binding = 3) readonly buffer DensityPressureBuffer
+{
+	vec2 density_pressure[];	// x: density, y: pressure
+};
+
+layout(std430, binding = 4) readonly buffer ActiveBuffer
+{
+	int is_active[];
+};
+
+// The maxima are kept as float bits, non-negative floats order the same as their bits.
+// The layout must match timestep_state in sph_sim.h.
+layout(std430, binding = 20) buffer TimestepBuffer
+{
+	float dt;
+	uint max_speed_bits;
+	uint max_accel_bits;
+};
+
+// Declare the group size, LOCAL_SIZE is injected by sph_sim.
+#ifndef LOCAL_SIZE
+#define LOCAL_SIZE 128
+#endif
+layout (local_size_x = LOCAL_SIZE, local_size_y = 1, local_size_z = 1) in;
+
+shared float group_speed[LOCAL_SIZE];
+shared float group_accel[LOCAL_SIZE];
+
+void main()
+{
+	uint index = gl_GlobalInvocationID.x;
+	uint lid = gl_LocalInvocationID.x;
+
+	// Every invocation has to reach the barriers, inactive ones contribute zero.
+	float speed = 0.0;
+	float accel = 0.0;
+	if (index < particle_count && is_active[index] != 0)
+	{
+		// just spawned particles have no density yet
+		float rho = density_pressure[index].x;
+		speed = length(velocities[index]);
+		accel = rho > 0.0 ? length(forces[index]) / rho : 0.0;
+	}
+	group_speed[lid] = speed;
+	group_accel[lid] = accel;
+	barrier();
+
+	// tree reduction within the workgroup, LOCAL_SIZE is a power of two
+	for (uint stride = LOCAL_SIZE / 2; stride > 0; stride /= 2)
+	{
+		if (lid < stride)
+		{
+			group_speed[lid] = max(group_speed[lid], group_speed[lid + stride]);
+			group_accel[lid] = max(group_accel[lid], group_accel[lid + stride]);
+		}
+		barrier();
+	}
+
+	if (lid == 0)
+	{
+		atomicMax(max_speed_bits, floatBitsToUint(group_speed[0]));
+		atomicMax(max_accel_bits, floatBitsToUint(group_accel[0]));
+	}
+}
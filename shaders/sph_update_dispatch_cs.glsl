@@ -0,0 +1,47 @@
+#version 440 core
+
+uniform uint max_particles;
+// Set after a sort, which moves the free slots to the end of the live range.
+uniform bool trim_free_slots;
+
+// Live particle count and the indirect arguments derived from it, laid out as
+// a DispatchIndirectCommand followed by a DrawArraysIndirectCommand.
+layout(std430, binding = 14) buffer DispatchBuffer
+{
+	uint dispatch_num_groups[3];
+	uint particle_count;
+	uint draw_count;
+	uint draw_instance_count;
+	uint draw_first;
+	uint draw_base_instance;
+	uint spawned_count;		// particles emitted since the last update
+	uint free_count;		// slots of removed particles awaiting reuse
+};
+
+#ifndef LOCAL_SIZE
+#define LOCAL_SIZE 128
+#endif
+
+layout (local_size_x = 1, local_size_y = 1, local_size_z = 1) in;
+
+void main()
+{
+	// Emitted particles join the live count, clamped to the buffer capacity.
+	uint count = min(particle_count + spawned_count, max_particles);
+	spawned_count = 0;
+	if (trim_free_slots)
+	{
+		count -= free_count;
+		free_count = 0;
+	}
+
+	particle_count = count;
+	dispatch_num_groups[0] = (count + LOCAL_SIZE - 1) / LOCAL_SIZE;
+	dispatch_num_groups[1] = 1;
+	dispatch_num_groups[2] = 1;
+
+	draw_count = count;
+	draw_instance_count = 1;
+	draw_first = 0;
+	draw_base_instance = 0;
+}
@@ -0,0 +1,92 @@
+#include "async_readback.h"
+
+
+async_readback::async_readback() :
+	m_buf(0),
+	m_mapping(nullptr),
+	m_slot_size(0),
+	m_next_slot(0),
+	m_pending(0)
+{
+}
+
+async_readback::~async_readback()
+{
+	for (readback_slot& slot : m_slots)
+		if (slot.fence)
+			glDeleteSync(slot.fence);
+
+	if (m_buf)
+	{
+		glBindBuffer(GL_COPY_WRITE_BUFFER, m_buf);
+		glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+		glDeleteBuffers(1, &m_buf);
+	}
+}
+
+void async_readback::init(GLsizeiptr slot_size, int slot_count)
+{
+	const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+	m_slot_size = slot_size;
+	m_slots.assign(slot_count, readback_slot{ 0, ready_callback() });
+
+	glGenBuffers(1, &m_buf);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_buf);
+	glBufferStorage(GL_COPY_WRITE_BUFFER, slot_size * slot_count, NULL, flags);
+	m_mapping = static_cast<const GLubyte*>(glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, slot_size * slot_count, flags));
+	if (!m_mapping)
+		throw unrecoverable_except("Could not map the readback buffer");
+}
+
+bool async_readback::request(const std::vector<copy_range>& ranges, ready_callback callback)
+{
+	if (m_pending == static_cast<int>(m_slots.size()))
+		return false;
+
+	GLintptr offset = m_next_slot * m_slot_size;
+	glBindBuffer(GL_COPY_WRITE_BUFFER, m_buf);
+	for (const copy_range& range : ranges)
+	{
+		if (offset + range.size > (m_next_slot + 1) * m_slot_size)
+			throw unrecoverable_except("Readback request larger than a slot");
+
+		glBindBuffer(GL_COPY_READ_BUFFER, range.src_buf);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, range.src_offset, offset, range.size);
+		offset += range.size;
+	}
+
+	readback_slot& slot = m_slots[m_next_slot];
+	slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slot.callback = callback;
+
+	m_next_slot = (m_next_slot + 1) % static_cast<int>(m_slots.size());
+	m_pending++;
+	return true;
+}
+
+void async_readback::poll()
+{
+	const int slot_count = static_cast<int>(m_slots.size());
+	while (m_pending > 0)
+	{
+		const int index = (m_next_slot - m_pending + slot_count) % slot_count;
+		readback_slot& slot = m_slots[index];
+
+		// Flush so the fence is sure to reach the GPU, but never wait.
+		GLenum result = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		if (result == GL_TIMEOUT_EXPIRED)
+			return;
+		if (result == GL_WAIT_FAILED)
+			throw unrecoverable_except("Polling a readback fence failed");
+
+		glDeleteSync(slot.fence);
+		slot.fence = 0;
+		m_pending--;
+
+		// The mapping is coherent, so the copy is visible once the fence has signalled.
+		ready_callback callback;
+		callback.swap(slot.callback);
+		callback(m_mapping + index * m_slot_size);
+	}
+}
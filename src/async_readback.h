@@ -0,0 +1,52 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <functional>
+#include <vector>
+
+#include "exception.h"
+
+// Reads buffer ranges back without stalling: the ranges are copied on the GPU
+// into a slot of a persistently mapped ring, fenced, and the slot is handed
+// to a callback once poll() finds the fence signalled, a frame or two later.
+class async_readback
+{
+public:
+	// Called with the slot contents, only valid for the duration of the call.
+	typedef std::function<void(const GLubyte* data)> ready_callback;
+
+	struct copy_range
+	{
+		GLuint src_buf;
+		GLintptr src_offset;
+		GLsizeiptr size;
+	};
+
+	async_readback();
+	~async_readback();
+
+	void init(GLsizeiptr slot_size, int slot_count);
+
+	// Copy the ranges back to back into a free slot, returns false when every
+	// slot is still waiting for the GPU and the request was dropped.
+	bool request(const std::vector<copy_range>& ranges, ready_callback callback);
+
+	// Hand finished slots to their callbacks, oldest first, never blocks.
+	void poll();
+
+	int pending() const { return m_pending; }
+
+private:
+	struct readback_slot
+	{
+		GLsync fence;
+		ready_callback callback;
+	};
+
+	GLuint m_buf;
+	const GLubyte* m_mapping;
+	GLsizeiptr m_slot_size;
+	std::vector<readback_slot> m_slots;
+	int m_next_slot;	// next slot to copy into
+	int m_pending;		// slots in flight, ending just before m_next_slot
+};
@@ -0,0 +1,299 @@
+#include "cpu_sph_solver.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+
+using Eigen::Vector2f;
+
+namespace
+{
+	// The jitter hash of sph_emit_cs.glsl, so both backends scatter alike.
+	uint32_t hash(uint32_t x)
+	{
+		x ^= x >> 16;
+		x *= 0x7feb352du;
+		x ^= x >> 15;
+		x *= 0x846ca68bu;
+		x ^= x >> 16;
+		return x;
+	}
+}
+
+cpu_sph_solver::cpu_sph_solver(unsigned int threads) :
+	m_pool(threads),
+	m_dt(DT),
+	m_step_count(0),
+	state_readback_interval(0),
+	steps_since_readback(0)
+{
+	grid_size[0] = static_cast<int>(std::ceil(boundary_size[0] / H));
+	grid_size[1] = static_cast<int>(std::ceil(boundary_size[1] / H));
+	m_cell_start.resize(grid_size[0] * grid_size[1] + 1);
+}
+
+void cpu_sph_solver::init_particles()
+{
+	m_boundary.bake();
+	emit(dam_emitter());
+}
+
+void cpu_sph_solver::emit(const emitter& e)
+{
+	if (e.shape == emitter_shape::nozzle)
+		throw unrecoverable_except("Nozzles are only supported by the OpenGL backend");
+
+	unsigned int columns, rows;
+	emitter_lattice(e, columns, rows);
+	const uint32_t seed = static_cast<uint32_t>(rand());
+
+	for (unsigned int n = 0; n < columns * rows && m_x.size() < MAX_PARTICLES; n++)
+	{
+		Vector2f x = Vector2f(e.origin[0], e.origin[1]) + Vector2f(float(n % columns), float(n / columns)) * e.spacing;
+		if (e.shape == emitter_shape::disc)
+		{
+			// the lattice covers the disc's bounding square, centred on it
+			x -= Vector2f::Constant(0.5f * float(columns - 1) * e.spacing);
+			if ((x - Vector2f(e.origin[0], e.origin[1])).norm() > e.size[0])
+				continue;
+		}
+
+		const uint32_t h = hash(seed ^ hash(n));
+		x += Vector2f(float(h & 0xffffu), float(h >> 16)) / 65536.f * e.jitter;
+
+		if (m_boundary.distance(x[0], x[1]) < 0.5f * EPS)
+			continue;
+
+		m_x.push_back(x);
+		m_v.push_back(Vector2f(e.velocity[0], e.velocity[1]));
+		m_f.push_back(Vector2f::Zero());
+		m_rho_p.push_back(Vector2f::Zero());
+		m_active.push_back(1);
+	}
+	m_particle_cell.resize(m_x.size());
+	m_sorted_index.resize(m_x.size());
+}
+
+void cpu_sph_solver::add_particle_block()
+{
+	if (m_x.size() >= MAX_PARTICLES)
+		std::cout << "maximum number of particles reached" << std::endl;
+	else
+		emit(block_emitter());
+}
+
+void cpu_sph_solver::step_particles()
+{
+	build_grid();
+	compute_density_pressure();
+	compute_forces();
+	if (m_adaptive_time_step)
+		update_time_step();
+	integrate();
+
+	m_step_count++;
+	if (state_readback_interval > 0 && ++steps_since_readback >= state_readback_interval)
+	{
+		hand_out_state();
+		steps_since_readback = 0;
+	}
+}
+
+void cpu_sph_solver::build_grid()
+{
+	// A serial counting sort, it is cheap next to the neighbour passes.
+	std::fill(m_cell_start.begin(), m_cell_start.end(), 0u);
+	for (size_t i = 0; i < m_x.size(); i++)
+	{
+		if (m_active[i] == 0)
+			continue;
+
+		// cells are H wide so all neighbours lie in the surrounding 3x3 cells
+		const int cx = std::min(std::max(static_cast<int>(m_x[i][0] / H), 0), grid_size[0] - 1);
+		const int cy = std::min(std::max(static_cast<int>(m_x[i][1] / H), 0), grid_size[1] - 1);
+		m_particle_cell[i] = cy * grid_size[0] + cx;
+		m_cell_start[m_particle_cell[i] + 1]++;
+	}
+
+	for (size_t c = 1; c < m_cell_start.size(); c++)
+		m_cell_start[c] += m_cell_start[c - 1];
+
+	std::vector<unsigned int> next(m_cell_start.begin(), m_cell_start.end() - 1);
+	for (size_t i = 0; i < m_x.size(); i++)
+		if (m_active[i] != 0)
+			m_sorted_index[next[m_particle_cell[i]]++] = static_cast<unsigned int>(i);
+}
+
+// Visits every particle in the 3x3 cells around x, as the grid variants of the shaders do.
+#define FOR_EACH_NEIGHBOUR(x, j, body) \
+	{ \
+		const int cell_x = std::min(std::max(static_cast<int>((x)[0] / H), 0), grid_size[0] - 1); \
+		const int cell_y = std::min(std::max(static_cast<int>((x)[1] / H), 0), grid_size[1] - 1); \
+		for (int cy = std::max(cell_y - 1, 0); cy <= std::min(cell_y + 1, grid_size[1] - 1); cy++) \
+			for (int cx = std::max(cell_x - 1, 0); cx <= std::min(cell_x + 1, grid_size[0] - 1); cx++) \
+			{ \
+				const int cell_index = cy * grid_size[0] + cx; \
+				for (unsigned int k = m_cell_start[cell_index]; k < m_cell_start[cell_index + 1]; k++) \
+				{ \
+					const unsigned int j = m_sorted_index[k]; \
+					body \
+				} \
+			} \
+	}
+
+void cpu_sph_solver::compute_density_pressure()
+{
+	m_pool.parallel_for(m_x.size(), [this](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			if (m_active[i] == 0)
+				continue;
+
+			const Vector2f xi = m_x[i];
+			float rho = 0.f;
+			FOR_EACH_NEIGHBOUR(xi, j,
+			{
+				const float r2 = (m_x[j] - xi).squaredNorm();
+				// this computation is symmetric
+				if (r2 < HSQ)
+					rho += MASS*POLY6*std::pow(HSQ - r2, 3.f);
+			})
+			m_rho_p[i] = Vector2f(rho, GAS_CONST*(rho - REST_DENS));
+		}
+	});
+}
+
+void cpu_sph_solver::compute_forces()
+{
+	m_pool.parallel_for(m_x.size(), [this](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			if (m_active[i] == 0)
+				continue;
+
+			const Vector2f xi = m_x[i];
+			const Vector2f vi = m_v[i];
+			const float pi = m_rho_p[i][1];
+			Vector2f fpress(0.f, 0.f);
+			Vector2f fvisc(0.f, 0.f);
+			FOR_EACH_NEIGHBOUR(xi, j,
+			{
+				const Vector2f rij = m_x[j] - xi;
+				const float r = rij.norm();
+				// r == 0 happens when the boundary clamps two particles onto the same spot
+				if (j != i && r < H && r != 0.f)
+				{
+					// compute pressure force contribution
+					fpress += -rij / r*MASS*(pi + m_rho_p[j][1]) / (2.f * m_rho_p[j][0]) * SPIKY_GRAD*std::pow(H - r, 2.f);
+					// compute viscosity force contribution
+					fvisc += VISC*MASS*(m_v[j] - vi) / m_rho_p[j][0] * VISC_LAP*(H - r);
+				}
+			})
+			const Vector2f fgrav = G * m_rho_p[i][0];
+			m_f[i] = fpress + fvisc + fgrav;
+		}
+	});
+}
+
+void cpu_sph_solver::update_time_step()
+{
+	// A NaN is kept once seen, as the GPU's atomicMax on the float bits does.
+	auto max_keep_nan = [](float max, float value) { return std::isnan(max) || max > value ? max : value; };
+
+	float max_speed = 0.f;
+	float max_accel = 0.f;
+	for (size_t i = 0; i < m_x.size(); i++)
+	{
+		if (m_active[i] == 0)
+			continue;
+
+		// just spawned particles have no density yet
+		const float rho = m_rho_p[i][0];
+		max_speed = max_keep_nan(max_speed, m_v[i].norm());
+		max_accel = max_keep_nan(max_accel, rho > 0.f ? m_f[i].norm() / rho : 0.f);
+	}
+
+	// No particle may cross more than a fraction of the kernel radius in one step.
+	float next_dt = DT_MAX;
+	if (max_speed > 0.f)
+		next_dt = std::min(next_dt, CFL_NUMBER * H / max_speed);
+	if (max_accel > 0.f)
+		next_dt = std::min(next_dt, FORCE_NUMBER * std::sqrt(H / max_accel));
+
+	// A NaN maximum fails both tests above and would leave dt at DT_MAX, so
+	// fall back to the smallest step instead. An infinite one already gives 0.
+	if (std::isnan(max_speed) || std::isnan(max_accel))
+		m_dt = DT_MIN;
+	else
+		m_dt = std::min(std::max(next_dt, DT_MIN), DT_MAX);
+}
+
+void cpu_sph_solver::integrate()
+{
+	const float dt = m_dt;
+	m_pool.parallel_for(m_x.size(), [this, dt](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; i++)
+		{
+			if (m_active[i] == 0)
+				continue;
+
+			// forward Euler integration
+			Vector2f v = m_v[i] + dt*m_f[i] / m_rho_p[i][0];
+			Vector2f x = m_x[i] + dt*v;
+
+			// Particles closer than EPS to a solid are pushed back out along its
+			// normal and their velocity into it is damped, as in sph_integrate_cs.glsl.
+			float distance;
+			float normal[2];
+			m_boundary.sample(x[0], x[1], distance, normal);
+			const float depth = EPS - distance;
+			const float normal_length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1]);
+			if (depth > 0.f && normal_length > 0.f)
+			{
+				const Vector2f n = Vector2f(normal[0], normal[1]) / normal_length;
+				x += depth * n;
+				const float vn = v.dot(n);
+				if (vn < 0.f)
+					v -= (1.f - BOUND_DAMPING) * vn * n;
+			}
+			// the field and the grid end at the domain
+			x = x.cwiseMax(Vector2f::Zero()).cwiseMin(boundary_size);
+
+			m_x[i] = x;
+			m_v[i] = v;
+		}
+	});
+}
+
+void cpu_sph_solver::set_state_readback(int steps, particle_snapshot_callback callback)
+{
+	state_readback_interval = steps;
+	state_readback_callback = callback;
+}
+
+void cpu_sph_solver::finish_state_readback()
+{
+	// unless the last step already handed out this state
+	if (state_readback_interval == 0 || steps_since_readback > 0)
+		hand_out_state();
+}
+
+void cpu_sph_solver::hand_out_state()
+{
+	if (!state_readback_callback)
+		return;
+
+	particle_snapshot snapshot;
+	snapshot.step = m_step_count;
+	snapshot.count = static_cast<unsigned int>(m_x.size());
+	snapshot.x = m_x.empty() ? nullptr : m_x[0].data();
+	snapshot.v = m_v.empty() ? nullptr : m_v[0].data();
+	snapshot.rho_p = m_rho_p.empty() ? nullptr : m_rho_p[0].data();
+	snapshot.active = m_active.empty() ? nullptr : m_active.data();
+	state_readback_callback(snapshot);
+}
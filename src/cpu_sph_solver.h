@@ -0,0 +1,70 @@
+#pragma once
+
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "sph_solver.h"
+#include "thread_pool.h"
+
+// The equation of state solver on the host, its passes split across a thread
+// pool. Steps the same grid neighbour search, adaptive time step, obstacles
+// and box or disc emitters as sph_sim, without needing an OpenGL context.
+// Sleeping, nozzles and sinks are left to the GPU backend.
+class cpu_sph_solver : public sph_solver
+{
+public:
+	// 0 threads uses one per hardware thread.
+	explicit cpu_sph_solver(unsigned int threads = 0);
+
+	const char* backend_name() const override { return "CPU"; }
+	unsigned int thread_count() const { return m_pool.thread_count(); }
+
+	void init_particles() override;
+	void step_particles() override;
+	void add_particle_block() override;
+
+	// Spawn the lattice of a box or disc emitter, positions inside a solid are skipped.
+	void emit(const emitter& e);
+
+	// Always current, the state never leaves the host.
+	int particle_count() const override { return static_cast<int>(m_x.size()); }
+	float time_step() const override { return m_dt; }
+
+	// The callback runs from step_particles() itself, as soon as the step is done.
+	void set_state_readback(int steps, particle_snapshot_callback callback) override;
+	void finish_state_readback() override;
+
+private:
+	void build_grid();
+	void compute_density_pressure();
+	void compute_forces();
+	void update_time_step();
+	void integrate();
+	void hand_out_state();
+
+	// same limit as the GPU particle buffers
+	const static unsigned int MAX_PARTICLES = 256 * 256;
+
+	thread_pool m_pool;
+
+	// particle state, one vector per field like the GPU buffers
+	std::vector<Eigen::Vector2f> m_x;
+	std::vector<Eigen::Vector2f> m_v;
+	std::vector<Eigen::Vector2f> m_f;
+	std::vector<Eigen::Vector2f> m_rho_p;	// x: density, y: pressure
+	std::vector<int> m_active;
+
+	// uniform grid, cells are H wide, particle indices counting sorted by cell
+	int grid_size[2];
+	std::vector<unsigned int> m_cell_start;	// grid_size[0]*grid_size[1] + 1 entries
+	std::vector<unsigned int> m_particle_cell;
+	std::vector<unsigned int> m_sorted_index;
+
+	float m_dt;
+
+	unsigned long m_step_count;
+	int state_readback_interval;
+	int steps_since_readback;
+	particle_snapshot_callback state_readback_callback;
+};
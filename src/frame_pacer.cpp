@@ -0,0 +1,115 @@
+#include "frame_pacer.h"
+
+
+frame_pacer::frame_pacer(int frames_in_flight) :
+	m_frames_in_flight(2),
+	m_start_query(0),
+	m_cpu_submit_total(0.0),
+	m_cpu_submit_count(0),
+	m_gpu_complete_total(0.0),
+	m_gpu_complete_count(0)
+{
+	set_frames_in_flight(frames_in_flight);
+}
+
+frame_pacer::~frame_pacer()
+{
+	for (frame_fence& frame : m_frames)
+	{
+		glDeleteSync(frame.fence);
+		glDeleteQueries(1, &frame.start_query);
+		glDeleteQueries(1, &frame.end_query);
+	}
+	if (m_start_query)
+		glDeleteQueries(1, &m_start_query);
+}
+
+void frame_pacer::set_frames_in_flight(int frames_in_flight)
+{
+	if (frames_in_flight < 1 || frames_in_flight > MAX_FRAMES_IN_FLIGHT)
+		throw unrecoverable_except("Frames in flight must be between 1 and 3");
+
+	m_frames_in_flight = frames_in_flight;
+}
+
+bool frame_pacer::retire_oldest(bool block)
+{
+	frame_fence& frame = m_frames.front();
+
+	// Flush on the first wait so the fence is guaranteed to reach the GPU.
+	GLbitfield flags = block ? GL_SYNC_FLUSH_COMMANDS_BIT : 0;
+	GLuint64 timeout = block ? 1000000000 : 0;
+	for (;;)
+	{
+		GLenum result = glClientWaitSync(frame.fence, flags, timeout);
+		if (result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED)
+			break;
+		if (result == GL_WAIT_FAILED)
+			throw unrecoverable_except("Waiting for a frame fence failed");
+		if (!block)
+			return false;
+		flags = 0;
+	}
+
+	// Both timestamps precede the fence, so their results are available now.
+	GLuint64 start_ns, end_ns;
+	glGetQueryObjectui64v(frame.start_query, GL_QUERY_RESULT, &start_ns);
+	glGetQueryObjectui64v(frame.end_query, GL_QUERY_RESULT, &end_ns);
+	m_gpu_complete_total += (end_ns - start_ns) / 1.0e6;
+	m_gpu_complete_count++;
+
+	glDeleteSync(frame.fence);
+	glDeleteQueries(1, &frame.start_query);
+	glDeleteQueries(1, &frame.end_query);
+	m_frames.pop_front();
+	return true;
+}
+
+void frame_pacer::begin_frame()
+{
+	// Retire whatever has already finished, then wait for a free slot.
+	while (!m_frames.empty() && retire_oldest(false))
+		;
+	while (static_cast<int>(m_frames.size()) >= m_frames_in_flight)
+		retire_oldest(true);
+
+	m_frame_start = clock::now();
+	if (!m_start_query)
+		glGenQueries(1, &m_start_query);
+	glQueryCounter(m_start_query, GL_TIMESTAMP);
+}
+
+void frame_pacer::end_frame()
+{
+	clock::time_point submitted = clock::now();
+
+	frame_fence frame;
+	frame.start_query = m_start_query;
+	m_start_query = 0;
+	glGenQueries(1, &frame.end_query);
+	glQueryCounter(frame.end_query, GL_TIMESTAMP);
+	frame.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	m_frames.push_back(frame);
+
+	std::chrono::duration<double, std::milli> cpu_time = submitted - m_frame_start;
+	m_cpu_submit_total += cpu_time.count();
+	m_cpu_submit_count++;
+}
+
+double frame_pacer::cpu_submit_ms() const
+{
+	return m_cpu_submit_count ? m_cpu_submit_total / m_cpu_submit_count : 0.0;
+}
+
+double frame_pacer::gpu_complete_ms() const
+{
+	return m_gpu_complete_count ? m_gpu_complete_total / m_gpu_complete_count : 0.0;
+}
+
+void frame_pacer::reset_stats()
+{
+	m_cpu_submit_total = 0.0;
+	m_cpu_submit_count = 0;
+	m_gpu_complete_total = 0.0;
+	m_gpu_complete_count = 0;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <chrono>
+#include <deque>
+
+#include "exception.h"
+
+// Limits how many frames the CPU may queue ahead of the GPU using one fence
+// per frame, instead of draining the pipeline with glFinish() every frame.
+class frame_pacer
+{
+public:
+	static const int MAX_FRAMES_IN_FLIGHT = 3;
+
+	frame_pacer(int frames_in_flight = 2);
+	~frame_pacer();
+
+	void set_frames_in_flight(int frames_in_flight);
+	int get_frames_in_flight() const { return m_frames_in_flight; }
+
+	// Call before submitting a frame, blocks until a frame slot is free.
+	void begin_frame();
+	// Call after the last GL command of the frame.
+	void end_frame();
+
+	// Averages since the last reset_stats(), in milliseconds.
+	// CPU submit: begin_frame() to end_frame(), excluding the slot wait.
+	// GPU completion: GL_TIMESTAMP queries issued at begin_frame() and next to
+	// the fence in end_frame(), i.e. the GPU time spent on the frame's commands.
+	double cpu_submit_ms() const;
+	double gpu_complete_ms() const;
+	void reset_stats();
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	struct frame_fence
+	{
+		GLsync fence;
+		GLuint start_query;
+		GLuint end_query;
+	};
+
+	// Retire the oldest frame, waiting for it if block is set.
+	bool retire_oldest(bool block);
+
+	int m_frames_in_flight;
+	std::deque<frame_fence> m_frames;
+	clock::time_point m_frame_start;
+	GLuint m_start_query;
+
+	double m_cpu_submit_total;
+	int m_cpu_submit_count;
+	double m_gpu_complete_total;
+	int m_gpu_complete_count;
+};
@@ -1,6 +1,23 @@
 #include "gl_shader.h"
 #include "exception.h"
 
+#include <cstdio>
+#include <cstdint>
+#include <sstream>
+#include <iomanip>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#define make_dir(path) _mkdir(path)
+#define process_id() _getpid()
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#define make_dir(path) mkdir(path, 0755)
+#define process_id() getpid()
+#endif
+
 
 static bool read_file_text(const std::string& path, std::string& text_out)
 {
@@ -22,13 +39,52 @@ static bool read_file_text(const std::string& path, std::string& text_out)
     return true;
 }
 
+// 64 bit FNV-1a, only used to name cache files, the full key is checked on load.
+static uint64_t fnv1a_64(const std::string& data)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : data)
+    {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static std::string driver_string()
+{
+    std::string driver;
+    const GLenum names[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+    for (GLenum name : names)
+    {
+        const GLubyte* str = glGetString(name);
+        driver += str ? reinterpret_cast<const char*>(str) : "";
+        driver += '\n';
+    }
+    return driver;
+}
+
+// Cache file layout: magic, key length, key, binary format, binary length, binary.
+static const char BINARY_CACHE_MAGIC[4] = { 'S', 'P', 'H', 'B' };
+
 // ----------------------------------------------------------------------------
 // gl_shader
 // ----------------------------------------------------------------------------
 
+std::string gl_shader::s_binary_cache_dir;
+bool gl_shader::s_parallel_compile = false;
+
+void gl_shader::set_binary_cache_dir(const std::string& dir)
+{
+    s_binary_cache_dir = dir;
+    if (!dir.empty())
+        make_dir(dir.c_str());	// fails harmlessly if it already exists
+}
+
 gl_shader::gl_shader()
 {
     m_prog_id = 0;
+    m_submitted = false;
     m_shader_initialised = false;
 }
 
@@ -55,6 +111,33 @@ void gl_shader::add_uniform(const std::string& name)
     m_sha_unif.push_back(sv);
 }
 
+void gl_shader::add_define(const std::string& name, const std::string& value)
+{
+    gl_shader_define sd = {name, value};
+    m_sha_defines.push_back(sd);
+}
+
+std::string gl_shader::inject_defines(const std::string& code) const
+{
+    if (m_sha_defines.empty())
+        return code;
+
+    std::string defines;
+    for (auto it = m_sha_defines.begin(); it != m_sha_defines.end(); ++it)
+        defines += "#define " + it->name + " " + it->value + "\n";
+
+    // GLSL requires #version to be the first statement, so insert after it.
+    size_t pos = code.find("#version");
+    if (pos == std::string::npos)
+        return defines + code;
+
+    pos = code.find('\n', pos);
+    if (pos == std::string::npos)
+        return code + "\n" + defines;
+
+    return code.substr(0, pos + 1) + defines + code.substr(pos + 1);
+}
+
 GLuint gl_shader::get_attribute(const std::string& name) 
 {
     for (auto it = m_sha_attrib.begin(); it != m_sha_attrib.end(); ++it)
@@ -72,57 +155,66 @@ GLuint gl_shader::get_uniform(const std::string& name)
 }
 
 void gl_shader::init_cs_from_file(const std::string& cs_file_path)
+{
+	submit_cs_from_file(cs_file_path);
+	finish();
+}
+
+void gl_shader::init_cs_from_str(const std::string& cs_code)
+{
+	submit_cs_from_str(cs_code);
+	finish();
+}
+
+void gl_shader::init_vs_fs_from_file(const std::string& vs_file_path, const std::string& fs_file_path)
+{
+    submit_vs_fs_from_file(vs_file_path, fs_file_path);
+    finish();
+}
+
+void gl_shader::init_vs_fs_from_str(const std::string& vs_code, const std::string& fs_code)
+{
+    submit_vs_fs_from_str(vs_code, fs_code);
+    finish();
+}
+
+void gl_shader::submit_cs_from_file(const std::string& cs_file_path)
 {
 	std::string cs_code;
 	if (!read_file_text(cs_file_path, cs_code))
 		throw unrecoverable_except("Failed to open compute shader file for reading");
 
-	init_cs_from_str(cs_code);
+	submit_cs_from_str(cs_code);
 }
 
-void gl_shader::init_cs_from_str(const std::string& cs_code)
+void gl_shader::submit_cs_from_str(const std::string& cs_code)
 {
 	//on_gl_error(oglERR_CLEAR); 
 
-	if (m_shader_initialised)
+	if (m_shader_initialised || m_submitted)
 		throw unrecoverable_except("Shader already initialised");
 
-	const GLchar* cs_code_cstr = cs_code.c_str();
+	enable_parallel_compile();
 
-	// Create and compile compute shader.
-	m_cs_id = glCreateShader(GL_COMPUTE_SHADER);
-	glShaderSource(m_cs_id, 1, &cs_code_cstr, NULL);
+	const std::string cs_src = inject_defines(cs_code);
 
-	//on_gl_error(oglERR_SHADERCREATE);
-
-	if (!compile(m_cs_id))
-		throw unrecoverable_except("Compute shader compile error");
+	m_key_src = "cs\n" + cs_src;
+	m_cache_path = binary_cache_path(m_key_src);
+	m_submitted = true;
+	if (load_program_binary(m_cache_path, m_key_src))
+		return;
 
+	// Create and compile compute shader, the status is only checked in finish().
 	m_prog_id = glCreateProgram();
+	submit_stage(GL_COMPUTE_SHADER, cs_src);
 
-	glAttachShader(m_prog_id, m_cs_id);
-
-	if (!link_prog(m_prog_id))
-		throw unrecoverable_except("Compute shader link error");
+	if (!m_cache_path.empty())
+		glProgramParameteri(m_prog_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 
-	glDetachShader(m_prog_id, m_cs_id);
-	glDeleteShader(m_cs_id);
-
-	//on_gl_error(oglERR_JUSTLOG, "Shader successfully compiled and linked.");
-
-	// After linking, we can get locations for uniforms.
-	for (auto it = m_sha_unif.begin(); it != m_sha_unif.end(); ++it)
-	{
-		GLint glret = glGetUniformLocation(m_prog_id, it->name.c_str());
-		if (glret == -1)
-			throw unrecoverable_except("Unused or unrecognized uniform");
-		it->loc = glret;
-	}
-
-	m_shader_initialised = true;
+	glLinkProgram(m_prog_id);
 }
 
-void gl_shader::init_vs_fs_from_file(const std::string& vs_file_path, const std::string& fs_file_path)
+void gl_shader::submit_vs_fs_from_file(const std::string& vs_file_path, const std::string& fs_file_path)
 {
     std::string vs_code;
     if (!read_file_text(vs_file_path, vs_code))
@@ -132,76 +224,251 @@ void gl_shader::init_vs_fs_from_file(const std::string& vs_file_path, const std:
     if (!read_file_text(fs_file_path, fs_code))
         throw unrecoverable_except("Failed to open fragment shader file for reading");
 
-	init_vs_fs_from_str(vs_code, fs_code);
+    submit_vs_fs_from_str(vs_code, fs_code);
 }
 
-void gl_shader::init_vs_fs_from_str(const std::string& vs_code, const std::string& fs_code)
+void gl_shader::submit_vs_fs_from_str(const std::string& vs_code, const std::string& fs_code)
 {
-	if (m_shader_initialised)
-		throw unrecoverable_except("Shader already initialised");
+    if (m_shader_initialised || m_submitted)
+        throw unrecoverable_except("Shader already initialised");
 
     //on_gl_error(oglERR_CLEAR); 
 
-    const GLchar* vs_code_cstr = vs_code.c_str();
-    const GLchar* fs_code_cstr = fs_code.c_str();
+    enable_parallel_compile();
 
-    // Create a compile vertex shader.
-    m_vs_id = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(m_vs_id, 1, &vs_code_cstr, NULL);
+    const std::string vs_src = inject_defines(vs_code);
+    const std::string fs_src = inject_defines(fs_code);
 
-    //on_gl_error(oglERR_SHADERCREATE);
+    // Attribute locations are baked into the binary, so they are part of the key.
+    GLuint loc = 0;
+    m_key_src = "vs\n" + vs_src + "fs\n" + fs_src + "attributes\n";
+    for (auto it = m_sha_attrib.begin(); it != m_sha_attrib.end(); ++it)
+    {
+        it->loc = loc++;
+        m_key_src += it->name + "\n";
+    }
+
+    m_cache_path = binary_cache_path(m_key_src);
+    m_submitted = true;
+    if (load_program_binary(m_cache_path, m_key_src))
+        return;
+
+    // Create and compile the vertex and fragment shaders, the status is only checked in finish().
+    m_prog_id = glCreateProgram();
+    submit_stage(GL_VERTEX_SHADER, vs_src);
+    submit_stage(GL_FRAGMENT_SHADER, fs_src);
 
-    if (!compile(m_vs_id))
-        throw unrecoverable_except("Shader compile error");
+    // Bind the attribute locations assigned above.
+    for(auto it = m_sha_attrib.begin(); it != m_sha_attrib.end(); ++it)
+        glBindAttribLocation(m_prog_id, it->loc, it->name.c_str());
+
+    if (!m_cache_path.empty())
+        glProgramParameteri(m_prog_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
+    glLinkProgram(m_prog_id);
+}
+
+void gl_shader::submit_stage(GLenum type, const std::string& src)
+{
+    const GLchar* src_cstr = src.c_str();
 
-    // Create and compile fragment shader.
-    m_fs_id = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(m_fs_id, 1, &fs_code_cstr, NULL);
+    GLuint shader_id = glCreateShader(type);
+    glShaderSource(shader_id, 1, &src_cstr, NULL);
+    glCompileShader(shader_id);
+    glAttachShader(m_prog_id, shader_id);
 
     //on_gl_error(oglERR_SHADERCREATE);
 
-    if (!compile(m_fs_id))
-        throw unrecoverable_except("Shader compile error");
+    m_stage_ids.push_back(shader_id);
+}
 
-    m_prog_id = glCreateProgram();
+bool gl_shader::is_ready() const
+{
+    if (!m_submitted || m_shader_initialised || m_stage_ids.empty() || !s_parallel_compile)
+        return true;
 
-    glAttachShader(m_prog_id, m_vs_id);
-    glAttachShader(m_prog_id, m_fs_id);
-    
-    // Store locations of attributes.
-    GLuint loc = 0;
-    for(auto it = m_sha_attrib.begin(); it != m_sha_attrib.end(); ++it)
-	{
-        it->loc = loc++;
-        glBindAttribLocation(m_prog_id, it->loc, it->name.c_str());
-    }
+    GLint done = GL_FALSE;
+    glGetProgramiv(m_prog_id, GL_COMPLETION_STATUS_ARB, &done);
+    return done == GL_TRUE;
+}
 
-    if (!link_prog(m_prog_id))
-        throw unrecoverable_except("Shader link error");
+void gl_shader::finish()
+{
+    if (m_shader_initialised)
+        return;
+    if (!m_submitted)
+        throw unrecoverable_except("Shader not submitted");
+
+    // Empty when the program came from the binary cache.
+    if (!m_stage_ids.empty())
+    {
+        for (GLuint shader_id : m_stage_ids)
+            if (!compile(shader_id))
+                throw unrecoverable_except("Shader compile error");
+
+        if (!link_prog(m_prog_id))
+            throw unrecoverable_except("Shader link error");
+
+        for (GLuint shader_id : m_stage_ids)
+        {
+            glDetachShader(m_prog_id, shader_id);
+            glDeleteShader(shader_id);
+        }
+        m_stage_ids.clear();
 
-    glDetachShader(m_prog_id, m_vs_id);
-    glDeleteShader(m_vs_id);
-    glDetachShader(m_prog_id, m_fs_id);
-    glDeleteShader(m_fs_id);
+        //on_gl_error(oglERR_JUSTLOG, "Shaders successfully compiled and linked.");
 
-    //on_gl_error(oglERR_JUSTLOG, "Shaders successfully compiled and linked.");
+        save_program_binary(m_cache_path, m_key_src);
+    }
 
     // After linking, we can get locations for uniforms.
+    find_uniforms();
+
+    m_shader_initialised = true;
+}
+
+void gl_shader::enable_parallel_compile()
+{
+    static bool checked = false;
+    if (checked)
+        return;
+    checked = true;
+
+    // Let the driver compile on as many threads as it likes.
+    if (GLEW_ARB_parallel_shader_compile)
+    {
+        glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+        s_parallel_compile = true;
+    }
+}
+
+void gl_shader::find_uniforms()
+{
     for (auto it = m_sha_unif.begin(); it != m_sha_unif.end(); ++it)
-	{
+    {
         GLint glret = glGetUniformLocation(m_prog_id, it->name.c_str());
         if (glret == -1)
             throw unrecoverable_except("Unused or unrecognized uniform");
         it->loc = glret;
     }
+}
 
-    m_shader_initialised = true;
+std::string gl_shader::binary_cache_path(const std::string& key_src) const
+{
+    if (s_binary_cache_dir.empty())
+        return std::string();
+
+    GLint format_count = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &format_count);
+    if (format_count == 0)
+        return std::string();
+
+    std::ostringstream path;
+    path << s_binary_cache_dir << "/" << std::hex << std::setw(16) << std::setfill('0')
+        << fnv1a_64(driver_string() + key_src) << ".bin";
+    return path.str();
 }
 
-bool gl_shader::compile(GLuint shader_id)
+bool gl_shader::load_program_binary(const std::string& path, const std::string& key_src)
 {
-    glCompileShader(shader_id);
+    if (path.empty())
+        return false;
 
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file.is_open())
+        return false;
+
+    // The stored key must match exactly, a hash collision or a driver update
+    // falls back to compiling.
+    const std::string key = driver_string() + key_src;
+    char magic[4];
+    uint64_t key_length = 0;
+    file.read(magic, sizeof(magic));
+    file.read(reinterpret_cast<char*>(&key_length), sizeof(key_length));
+    if (!file || std::string(magic, sizeof(magic)) != std::string(BINARY_CACHE_MAGIC, sizeof(BINARY_CACHE_MAGIC)) || key_length != key.size())
+        return false;
+
+    std::string stored_key(key.size(), '\0');
+    file.read(&stored_key[0], stored_key.size());
+    if (!file || stored_key != key)
+        return false;
+
+    GLenum format = 0;
+    uint64_t binary_length = 0;
+    file.read(reinterpret_cast<char*>(&format), sizeof(format));
+    file.read(reinterpret_cast<char*>(&binary_length), sizeof(binary_length));
+    if (!file)
+        return false;
+
+    std::vector<char> binary(binary_length);
+    file.read(binary.data(), binary.size());
+    if (!file)
+        return false;
+
+    m_prog_id = glCreateProgram();
+    glProgramBinary(m_prog_id, format, binary.data(), static_cast<GLsizei>(binary.size()));
+
+    GLint status = GL_FALSE;
+    glGetProgramiv(m_prog_id, GL_LINK_STATUS, &status);
+    if (status == GL_FALSE)
+    {
+        // Rejected by the driver, compile from source instead.
+        glDeleteProgram(m_prog_id);
+        m_prog_id = 0;
+        return false;
+    }
+    return true;
+}
+
+void gl_shader::save_program_binary(const std::string& path, const std::string& key_src)
+{
+    if (path.empty())
+        return;
+
+    GLint binary_length = 0;
+    glGetProgramiv(m_prog_id, GL_PROGRAM_BINARY_LENGTH, &binary_length);
+    if (binary_length <= 0)
+        return;
+
+    std::vector<char> binary(binary_length);
+    GLenum format = 0;
+    GLsizei written = 0;
+    glGetProgramBinary(m_prog_id, binary_length, &written, &format, binary.data());
+    if (written <= 0)
+        return;
+
+    // Write to a private file and rename it, so concurrent launches never see a partial entry.
+    const std::string key = driver_string() + key_src;
+    const uint64_t key_length = key.size();
+    const uint64_t stored_length = written;
+
+    std::ostringstream tmp_path;
+    tmp_path << path << ".tmp" << process_id();
+    {
+        std::ofstream file(tmp_path.str().c_str(), std::ios::binary);
+        if (!file.is_open())
+            return;
+
+        file.write(BINARY_CACHE_MAGIC, sizeof(BINARY_CACHE_MAGIC));
+        file.write(reinterpret_cast<const char*>(&key_length), sizeof(key_length));
+        file.write(key.data(), key.size());
+        file.write(reinterpret_cast<const char*>(&format), sizeof(format));
+        file.write(reinterpret_cast<const char*>(&stored_length), sizeof(stored_length));
+        file.write(binary.data(), written);
+        if (!file)
+        {
+            file.close();
+            std::remove(tmp_path.str().c_str());
+            return;
+        }
+    }
+
+    if (std::rename(tmp_path.str().c_str(), path.c_str()) != 0)
+        std::remove(tmp_path.str().c_str());
+}
+
+bool gl_shader::compile(GLuint shader_id)
+{
     GLint param = 0;
     glGetShaderiv(shader_id, GL_COMPILE_STATUS, &param);
 
@@ -215,7 +482,9 @@ bool gl_shader::compile(GLuint shader_id)
             int nchars = 0;
             glGetShaderInfoLog(shader_id, param, &nchars, info);
             //on_gl_error(oglERR_SHADERCOMPILE, info);
-			throw unrecoverable_except("Shader compile error");
+            std::string msg = std::string("Shader compile error: ") + info;
+            delete [] info;
+			throw unrecoverable_except(msg);
         }
         return false;
     }
@@ -224,8 +493,6 @@ bool gl_shader::compile(GLuint shader_id)
 
 bool gl_shader::link_prog(GLuint program_id) 
 {
-    glLinkProgram(program_id);
-
     GLint param = 0;
     glGetProgramiv(program_id, GL_LINK_STATUS, &param);
 
@@ -15,6 +15,14 @@ struct gl_shader_var
 
 typedef std::vector<gl_shader_var> gl_shader_var_v;
 
+struct gl_shader_define
+{
+    std::string name;   // The name of the preprocessor macro.
+    std::string value;  // The replacement text, may be empty.
+};
+
+typedef std::vector<gl_shader_define> gl_shader_define_v;
+
 class gl_shader 
 {
 public:
@@ -33,24 +41,61 @@ public:
     // Initialise fragment/vertex shader program from strings.
     void init_vs_fs_from_str(const std::string& vs_code, const std::string& fs_code);
 
+    // Start compiling and linking without waiting on the driver, so several
+    // programs can build in parallel. finish() must be called before use.
+    void submit_cs_from_file(const std::string& cs_file_path);
+    void submit_cs_from_str(const std::string& cs_code);
+    void submit_vs_fs_from_file(const std::string& vs_file_path, const std::string& fs_file_path);
+    void submit_vs_fs_from_str(const std::string& vs_code, const std::string& fs_code);
+
+    // True once finish() will not block, always true without GL_ARB_parallel_shader_compile.
+    bool is_ready() const;
+    // Check the compile and link status, throws on errors, and look up the uniforms.
+    void finish();
+    bool is_initialised() const { return m_shader_initialised; }
+
     bool use();
     void stop_using();
     void clean_up();
 
     void add_attribute(const std::string& name);
     void add_uniform(const std::string& name);
+    // Add a #define that is injected after the #version line before compiling.
+    void add_define(const std::string& name, const std::string& value = "");
     GLuint get_attribute(const std::string& name);
     GLuint get_uniform(const std::string& name);
 
+    // Directory for linked program binaries, keyed by source, defines and driver.
+    // An empty path disables the cache.
+    static void set_binary_cache_dir(const std::string& dir);
+
 private:
+    // Check the status of a submitted compile or link, blocking until it is done.
     bool compile(GLuint sha_id);
     bool link_prog(GLuint pro_id);
+    void submit_stage(GLenum type, const std::string& src);
+    static void enable_parallel_compile();
+    std::string inject_defines(const std::string& code) const;
+    void find_uniforms();
+
+    // Program binary cache, key_src holds everything the binary depends on.
+    std::string binary_cache_path(const std::string& key_src) const;
+    bool load_program_binary(const std::string& path, const std::string& key_src);
+    void save_program_binary(const std::string& path, const std::string& key_src);
+
+    static std::string s_binary_cache_dir;
+    static bool s_parallel_compile;
 
     gl_shader_var_v m_sha_attrib;
     gl_shader_var_v m_sha_unif;
+    gl_shader_define_v m_sha_defines;
 
-    GLuint m_vs_id, m_fs_id, m_cs_id;
+    std::vector<GLuint> m_stage_ids;	// compiled stages until finish(), empty for cached binaries
     GLuint m_prog_id;
 
+    std::string m_key_src;		// binary cache key and path of the submitted program
+    std::string m_cache_path;
+
+    bool m_submitted;
     bool m_shader_initialised;
 };
\ No newline at end of file
@@ -0,0 +1,99 @@
+#include "gpu_timer.h"
+
+
+gpu_timer::~gpu_timer()
+{
+	for (const pass_query_v& frame : m_pending_frames)
+		for (const pass_query& q : frame)
+			m_free_queries.push_back(q.query);
+	for (const pass_query& q : m_current_frame)
+		m_free_queries.push_back(q.query);
+
+	if (!m_free_queries.empty())
+		glDeleteQueries(static_cast<GLsizei>(m_free_queries.size()), m_free_queries.data());
+}
+
+int gpu_timer::add_pass(const std::string& name)
+{
+	m_pass_names.push_back(name);
+	m_total_ms.push_back(0.0);
+	m_last_ms.push_back(0.0);
+	m_samples.push_back(0);
+	return pass_count() - 1;
+}
+
+void gpu_timer::begin(int pass)
+{
+	pass_query q;
+	q.pass = pass;
+	if (m_free_queries.empty())
+		glGenQueries(1, &q.query);
+	else
+	{
+		q.query = m_free_queries.back();
+		m_free_queries.pop_back();
+	}
+
+	glBeginQuery(GL_TIME_ELAPSED, q.query);
+	m_current_frame.push_back(q);
+}
+
+void gpu_timer::end()
+{
+	glEndQuery(GL_TIME_ELAPSED);
+}
+
+bool gpu_timer::collect(pass_query_v& frame)
+{
+	// Queries resolve in order, so the last one being ready means all are.
+	if (!frame.empty())
+	{
+		GLint available = 0;
+		glGetQueryObjectiv(frame.back().query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+			return false;
+	}
+
+	for (double& last : m_last_ms)
+		last = 0.0;
+
+	for (const pass_query& q : frame)
+	{
+		GLuint64 elapsed_ns = 0;
+		glGetQueryObjectui64v(q.query, GL_QUERY_RESULT, &elapsed_ns);
+		m_total_ms[q.pass] += elapsed_ns / 1.0e6;
+		m_last_ms[q.pass] += elapsed_ns / 1.0e6;
+		m_samples[q.pass]++;
+		m_free_queries.push_back(q.query);
+	}
+	m_completed_frames++;
+	return true;
+}
+
+void gpu_timer::end_frame()
+{
+	m_pending_frames.push_back(pass_query_v());
+	m_pending_frames.back().swap(m_current_frame);
+
+	while (!m_pending_frames.empty() && collect(m_pending_frames.front()))
+		m_pending_frames.pop_front();
+}
+
+double gpu_timer::average_ms(int pass) const
+{
+	return m_completed_frames ? m_total_ms[pass] / m_completed_frames : 0.0;
+}
+
+double gpu_timer::average_sample_ms(int pass) const
+{
+	return m_samples[pass] ? m_total_ms[pass] / m_samples[pass] : 0.0;
+}
+
+void gpu_timer::reset_stats()
+{
+	for (double& total : m_total_ms)
+		total = 0.0;
+	for (int& samples : m_samples)
+		samples = 0;
+	m_completed_frames = 0;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+// Times named GPU passes with GL_TIME_ELAPSED queries. Each frame's queries
+// are kept until the GPU has resolved them, so reading the results never
+// stalls, whatever the number of frames in flight.
+class gpu_timer
+{
+public:
+	gpu_timer() : m_completed_frames(0) {}
+	~gpu_timer();
+
+	// Register a pass, returns the id passed to begin()/end().
+	int add_pass(const std::string& name);
+	int pass_count() const { return static_cast<int>(m_pass_names.size()); }
+	const std::string& pass_name(int pass) const { return m_pass_names[pass]; }
+
+	// Time queries cannot nest, only one pass may be open at a time.
+	void begin(int pass);
+	void end();
+
+	// Close the current frame and collect the frames the GPU has finished.
+	void end_frame();
+
+	// Average GPU time per frame since reset_stats(), in milliseconds.
+	double average_ms(int pass) const;
+	// Average GPU time per timed run of the pass, for passes that skip frames.
+	double average_sample_ms(int pass) const;
+	void reset_stats();
+
+	// GPU time of the most recently collected frame, in milliseconds.
+	double last_frame_ms(int pass) const { return m_last_ms[pass]; }
+
+private:
+	struct pass_query
+	{
+		int pass;
+		GLuint query;
+	};
+
+	typedef std::vector<pass_query> pass_query_v;
+
+	bool collect(pass_query_v& frame);
+
+	std::vector<std::string> m_pass_names;
+	std::vector<GLuint> m_free_queries;
+	pass_query_v m_current_frame;
+	std::deque<pass_query_v> m_pending_frames;
+
+	std::vector<double> m_total_ms;
+	std::vector<double> m_last_ms;
+	std::vector<int> m_samples;
+	int m_completed_frames;
+};
@@ -0,0 +1,70 @@
+#include "headless_context.h"
+
+#include <EGL/eglext.h>
+#include <cstring>
+
+// Extension names are whole words of a space separated list.
+static bool has_extension(const char* extensions, const char* name)
+{
+	const size_t length = std::strlen(name);
+	for (const char* found = extensions ? std::strstr(extensions, name) : nullptr; found; found = std::strstr(found + length, name))
+		if ((found == extensions || found[-1] == ' ') && (found[length] == ' ' || found[length] == '\0'))
+			return true;
+	return false;
+}
+
+headless_context::headless_context() :
+	m_display(EGL_NO_DISPLAY),
+	m_context(EGL_NO_CONTEXT)
+{
+	// Mesa's surfaceless platform needs no display server at all, other
+	// drivers fall back to their default display.
+	const char* client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+		reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+	if (get_platform_display && has_extension(client_extensions, "EGL_MESA_platform_surfaceless"))
+		m_display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (m_display == EGL_NO_DISPLAY)
+		m_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (m_display == EGL_NO_DISPLAY || !eglInitialize(m_display, NULL, NULL))
+		throw unrecoverable_except("Could not initialize an EGL display");
+
+	const char* extensions = eglQueryString(m_display, EGL_EXTENSIONS);
+	if (!has_extension(extensions, "EGL_KHR_surfaceless_context"))
+		throw unrecoverable_except("EGL display does not support surfaceless contexts");
+	if (!eglBindAPI(EGL_OPENGL_API))
+		throw unrecoverable_except("EGL display does not support OpenGL");
+
+	// Without a surface the context needs no config when the display allows it.
+	EGLConfig config = EGL_NO_CONFIG_KHR;
+	if (!has_extension(extensions, "EGL_KHR_no_config_context"))
+	{
+		const EGLint config_attribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+		EGLint config_count = 0;
+		if (!eglChooseConfig(m_display, config_attribs, &config, 1, &config_count) || config_count == 0)
+			throw unrecoverable_except("No EGL config supports OpenGL");
+	}
+
+	const EGLint context_attribs[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 4,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE };
+	m_context = eglCreateContext(m_display, config, EGL_NO_CONTEXT, context_attribs);
+	if (m_context == EGL_NO_CONTEXT)
+		throw unrecoverable_except("Could not create an OpenGL 4.3 EGL context");
+
+	if (!eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, m_context))
+		throw unrecoverable_except("Could not make the EGL context current");
+}
+
+headless_context::~headless_context()
+{
+	if (m_context != EGL_NO_CONTEXT)
+	{
+		eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		eglDestroyContext(m_display, m_context);
+	}
+	if (m_display != EGL_NO_DISPLAY)
+		eglTerminate(m_display);
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <EGL/egl.h>
+
+#include "exception.h"
+
+// An OpenGL 4.3 core context without any window or surface, for batch runs
+// on machines without a display, such as Mesa's software rasterizer. It is
+// made current on construction and destroyed with the object.
+class headless_context
+{
+public:
+	headless_context();
+	~headless_context();
+
+	headless_context(const headless_context&) = delete;
+	headless_context& operator=(const headless_context&) = delete;
+
+private:
+	EGLDisplay m_display;
+	EGLContext m_context;
+};
@@ -2,8 +2,21 @@
 #include <GLFW/glfw3.h>
 #include <iostream>
 #include <sstream>
+#include <iomanip>
+#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <cerrno>
+#include <cstdlib>
+#include <cmath>
+#include <climits>
 
 #include "sph_sim.h"
+#include "cpu_sph_solver.h"
+#include "frame_pacer.h"
+#include "substep_scheduler.h"
+#include "headless_context.h"
 
 #include "exception.h"
 
@@ -18,7 +31,149 @@ GLFWwindow* window;
 
 int frame_count = 0;
 
+// The --headless context, declared ahead of the solver and the pacer so it is
+// destroyed after them, their destructors still release GL objects.
+std::unique_ptr<headless_context> headless_gl;
+
 sph_sim sph(window_size);
+frame_pacer pacer;
+substep_scheduler scheduler;
+
+// Optional per second timing log.
+std::ofstream timing_csv;
+
+// Optional particle statistics log, sampled every state_interval steps.
+std::ofstream state_csv;
+int state_interval = 100;
+
+// Statistics of the active particles of a snapshot.
+struct state_stats
+{
+	unsigned long step;
+	GLuint slots;
+	int active;
+	double mean_x, mean_y, mean_speed, max_speed, mean_density;
+};
+
+state_stats compute_state_stats(const particle_snapshot& snapshot)
+{
+	int active = 0;
+	double sum_x = 0.0, sum_y = 0.0, sum_speed = 0.0, max_speed = 0.0, sum_density = 0.0;
+	for (GLuint i = 0; i < snapshot.count; i++)
+	{
+		if (!snapshot.active[i])
+			continue;
+
+		double speed = sqrt(snapshot.v[i * 2] * snapshot.v[i * 2] + snapshot.v[i * 2 + 1] * snapshot.v[i * 2 + 1]);
+		sum_x += snapshot.x[i * 2];
+		sum_y += snapshot.x[i * 2 + 1];
+		sum_speed += speed;
+		max_speed = std::max(max_speed, speed);
+		sum_density += snapshot.rho_p[i * 2];
+		active++;
+	}
+
+	double n = active ? active : 1;
+	state_stats stats = { snapshot.step, snapshot.count, active, sum_x / n, sum_y / n, sum_speed / n, max_speed, sum_density / n };
+	return stats;
+}
+
+void write_state_stats(const particle_snapshot& snapshot)
+{
+	state_stats stats = compute_state_stats(snapshot);
+	state_csv << stats.step << "," << stats.slots << "," << stats.active << "," << stats.mean_x << "," << stats.mean_y
+		<< "," << stats.mean_speed << "," << stats.max_speed << "," << stats.mean_density << endl;
+}
+
+// Runs the given number of steps without drawing, the OpenGL backend in a
+// surfaceless EGL context, then prints the step rate and the statistics of the
+// final particle state.
+int run_headless(sph_solver& solver, int steps, const std::string& shader_cache_dir)
+{
+	try
+	{
+		sph_sim* gl_sim = dynamic_cast<sph_sim*>(&solver);
+		if (gl_sim)
+		{
+			headless_gl.reset(new headless_context());
+
+			glewExperimental = GL_TRUE;
+			GLenum err = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+			// GLEW built for GLX finds no X display, but the GL entry points are loaded by then.
+			if (err == GLEW_ERROR_NO_GLX_DISPLAY)
+				err = GLEW_OK;
+#endif
+			if (err != GLEW_OK)
+			{
+				cerr << "Error: " << glewGetErrorString(err) << endl;
+				return 1;
+			}
+		}
+
+		state_stats final_stats = {};
+		solver.set_state_readback(state_csv.is_open() ? state_interval : 0, [&final_stats](const particle_snapshot& snapshot)
+		{
+			if (state_csv.is_open())
+				write_state_stats(snapshot);
+			final_stats = compute_state_stats(snapshot);
+		});
+		if (state_csv.is_open())
+			state_csv << "step,slots,active,mean_x,mean_y,mean_speed,max_speed,mean_density" << endl;
+
+		if (gl_sim)
+			gl_shader::set_binary_cache_dir(shader_cache_dir);
+		solver.init_particles();
+		if (gl_sim)
+			gl_sim->finish_programs();
+
+		auto start = std::chrono::steady_clock::now();
+		for (int step = 0; step < steps; step++)
+		{
+			if (gl_sim)
+			{
+				// each step stands in for a frame, so the queue stays frames-in-flight deep
+				pacer.begin_frame();
+				gl_sim->step_particles();
+				gl_sim->pass_timer().end_frame();
+				pacer.end_frame();
+			}
+			else
+				solver.step_particles();
+		}
+		if (gl_sim)
+			glFinish();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		solver.finish_state_readback();
+		if (gl_sim)
+			gl_sim->pass_timer().end_frame();
+
+		cout << std::fixed << std::setprecision(2) << "backend: " << solver.backend_name();
+		if (cpu_sph_solver* cpu = dynamic_cast<cpu_sph_solver*>(&solver))
+			cout << " (" << cpu->thread_count() << " threads)";
+		cout << "\n" << steps << " steps in " << seconds << " s, " << steps / seconds << " steps/s"
+			<< "\nparticles: " << final_stats.active << " active in " << final_stats.slots << " slots"
+			<< "\nmean position: " << std::setprecision(4) << final_stats.mean_x << ", " << final_stats.mean_y
+			<< "\nmean speed: " << final_stats.mean_speed << ", max speed: " << final_stats.max_speed
+			<< "\nmean density: " << final_stats.mean_density;
+		if (gl_sim)
+		{
+			gpu_timer& pass_timer = gl_sim->pass_timer();
+			cout << "\nGPU passes (ms per step):";
+			for (int pass = 0; pass < pass_timer.pass_count(); pass++)
+				cout << "\n  " << pass_timer.pass_name(pass) << ": " << pass_timer.average_ms(pass);
+		}
+		cout << endl;
+	}
+	catch (unrecoverable_except& e)
+	{
+		cerr << "unrecoverable exception: " << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
 
 // Simulation info text.
 GLTtext *sim_info_text;
@@ -29,6 +184,14 @@ void keyboard_callback(GLFWwindow* window, int key, int scancode, int action, in
 	{
 		sph.add_particle_block();
 	}
+	else if (key == GLFW_KEY_N && action == GLFW_PRESS)
+	{
+		sph.toggle_nozzle();
+	}
+	else if (key == GLFW_KEY_D && action == GLFW_PRESS)
+	{
+		sph.toggle_drain();
+	}
 }
 
 void window_size_callback(GLFWwindow* window, int width, int height)
@@ -38,8 +201,160 @@ void window_size_callback(GLFWwindow* window, int width, int height)
 	sph.resize_window(window_size);
 }
 
+// Reads the value after option i as a whole number within [min, max] and steps
+// i over it. False on a missing, malformed or out of range value.
+bool int_option(int argc, char** argv, int& i, long min, long max, int& value)
+{
+	if (i + 1 >= argc)
+		return false;
+
+	char* end;
+	errno = 0;
+	long parsed = strtol(argv[i + 1], &end, 10);
+	if (end == argv[i + 1] || *end != '\0' || errno == ERANGE || parsed < min || parsed > max)
+		return false;
+
+	value = static_cast<int>(parsed);
+	i++;
+	return true;
+}
+
+// The same for a finite real number greater than above.
+bool double_option(int argc, char** argv, int& i, double above, double& value)
+{
+	if (i + 1 >= argc)
+		return false;
+
+	char* end;
+	errno = 0;
+	double parsed = strtod(argv[i + 1], &end);
+	if (end == argv[i + 1] || *end != '\0' || errno == ERANGE || !std::isfinite(parsed) || !(parsed > above))
+		return false;
+
+	value = parsed;
+	i++;
+	return true;
+}
+
 int main(int argc, char** argv)
 {
+	std::string shader_cache_dir = "shader_cache";
+	int headless_steps = 0;
+	// solver independent options are applied once the backend is known
+	bool cpu_backend = false;
+	unsigned int cpu_threads = 0;
+	std::string obstacles_path;
+	bool fixed_dt = false;
+	// options the CPU backend has no counterpart for, and the ones given
+	const std::vector<std::string> gpu_only_options = { "--brute-force", "--brute-force-tiled", "--local-size", "--specialize",
+		"--sleep", "--compact-interval", "--sort-interval", "--frames-in-flight", "--shader-cache", "--no-shader-cache" };
+	std::string gpu_only_given;
+
+	int int_value;
+	double double_value;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg(argv[i]);
+		if (std::find(gpu_only_options.begin(), gpu_only_options.end(), arg) != gpu_only_options.end())
+			gpu_only_given += " " + arg;
+
+		if (arg == "--brute-force")
+			sph.set_neighbour_search(neighbour_search::brute_force);
+		else if (arg == "--brute-force-tiled")
+			sph.set_neighbour_search(neighbour_search::brute_force_tiled);
+		else if (arg == "--local-size" && i + 1 < argc && (std::string(argv[i + 1]) == "64" || std::string(argv[i + 1]) == "128" || std::string(argv[i + 1]) == "256"))
+			sph.set_local_size(std::stoi(argv[++i]));
+		else if (arg == "--obstacles" && i + 1 < argc)
+			obstacles_path = argv[++i];
+		else if (arg == "--sleep")
+			sph.set_sleeping(true);
+		else if (arg == "--fixed-dt")
+			fixed_dt = true;
+		else if (arg == "--specialize")
+			sph.set_specialized_constants(true);
+		else if (arg == "--compact-interval" && int_option(argc, argv, i, 0, INT_MAX, int_value))
+			sph.set_compact_interval(int_value);
+		else if (arg == "--shader-cache" && i + 1 < argc)
+			shader_cache_dir = argv[++i];
+		else if (arg == "--no-shader-cache")
+			shader_cache_dir.clear();
+		else if (arg == "--sort-interval" && int_option(argc, argv, i, 0, INT_MAX, int_value))
+			sph.set_sort_interval(int_value);
+		else if (arg == "--frames-in-flight" && int_option(argc, argv, i, 1, frame_pacer::MAX_FRAMES_IN_FLIGHT, int_value))
+			pacer.set_frames_in_flight(int_value);
+		else if (arg == "--substeps" && int_option(argc, argv, i, 1, substep_scheduler::MAX_SUBSTEPS, int_value))
+			scheduler.set_max_substeps(int_value);
+		else if (arg == "--substep-budget" && double_option(argc, argv, i, 0.0, double_value))
+			scheduler.set_budget_ms(double_value);
+		else if (arg == "--sim-speed" && double_option(argc, argv, i, 0.0, double_value))
+			scheduler.set_sim_speed(double_value);
+		else if (arg == "--state-csv" && i + 1 < argc)
+		{
+			state_csv.open(argv[++i]);
+			if (!state_csv)
+			{
+				cerr << "ERROR: could not open " << argv[i] << endl;
+				return 1;
+			}
+		}
+		else if (arg == "--headless" && int_option(argc, argv, i, 1, INT_MAX, int_value))
+			headless_steps = int_value;
+		else if (arg == "--backend" && i + 1 < argc && (std::string(argv[i + 1]) == "gl" || std::string(argv[i + 1]) == "cpu"))
+			cpu_backend = std::string(argv[++i]) == "cpu";
+		else if (arg == "--threads" && int_option(argc, argv, i, 1, 1024, int_value))
+			cpu_threads = int_value;
+		else if (arg == "--state-interval" && int_option(argc, argv, i, 1, INT_MAX, int_value))
+			state_interval = int_value;
+		else if (arg == "--timing-csv" && i + 1 < argc)
+		{
+			timing_csv.open(argv[++i]);
+			if (!timing_csv)
+			{
+				cerr << "ERROR: could not open " << argv[i] << endl;
+				return 1;
+			}
+		}
+		else
+		{
+			cerr << "usage: " << argv[0] << " [--brute-force | --brute-force-tiled] [--local-size 64|128|256] [--specialize] [--fixed-dt] [--sleep] [--obstacles file] [--compact-interval steps] [--sort-interval steps] [--frames-in-flight 1|2|3]"
+				<< " [--substeps max | --substep-budget ms] [--sim-speed x] [--timing-csv file]"
+				<< " [--state-csv file [--state-interval steps]] [--shader-cache dir | --no-shader-cache] [--headless steps [--backend gl|cpu] [--threads n]]" << endl;
+			return 1;
+		}
+	}
+
+	if (cpu_backend && headless_steps == 0)
+	{
+		cerr << "ERROR: the CPU backend only runs with --headless" << endl;
+		return 1;
+	}
+	if (cpu_backend && !gpu_only_given.empty())
+	{
+		cerr << "ERROR: the CPU backend does not support" << gpu_only_given << endl;
+		return 1;
+	}
+
+	std::unique_ptr<cpu_sph_solver> cpu_solver;
+	if (cpu_backend)
+		cpu_solver.reset(new cpu_sph_solver(cpu_threads));
+	sph_solver& solver = cpu_backend ? static_cast<sph_solver&>(*cpu_solver) : sph;
+
+	try
+	{
+		if (!obstacles_path.empty())
+			solver.load_obstacles(obstacles_path);
+	}
+	catch (unrecoverable_except& e)
+	{
+		cerr << "unrecoverable exception: " << e.what() << endl;
+		return 1;
+	}
+	if (fixed_dt)
+		solver.set_adaptive_time_step(false);
+
+	if (headless_steps > 0)
+		return run_headless(solver, headless_steps, shader_cache_dir);
+
 	if (!glfwInit()) {
 		cerr << "ERROR: could not start GLFW3" << endl;
 		return 1;
@@ -72,18 +387,52 @@ int main(int argc, char** argv)
 		// Initialize glText
 		gltInit();
 
-		std::stringstream ss_text_info("FPS:\nParticles:");
+		std::stringstream ss_text_info("FPS:\nCPU submit:\nGPU complete:\nParticles:\nNeighbours:");
 		sim_info_text = gltCreateText();
 		gltSetText(sim_info_text, ss_text_info.str().c_str());
 
+		if (state_csv.is_open())
+		{
+			state_csv << "step,slots,active,mean_x,mean_y,mean_speed,max_speed,mean_density" << endl;
+			sph.set_state_readback(state_interval, write_state_stats);
+		}
+
+		// Show the window straight away rather than after the shaders compile.
+		glClear(GL_COLOR_BUFFER_BIT);
+		glfwSwapBuffers(window);
+
+		gl_shader::set_binary_cache_dir(shader_cache_dir);
 		sph.init_particles();
 
+		gpu_timer& pass_timer = sph.pass_timer();
+		if (timing_csv.is_open())
+		{
+			timing_csv << "time_s,fps,steps,particles,cpu_submit_ms,gpu_complete_ms";
+			for (int pass = 0; pass < pass_timer.pass_count(); pass++)
+				timing_csv << "," << pass_timer.pass_name(pass) << "_ms";
+			timing_csv << endl;
+		}
+
 		double previous_time = glfwGetTime();
+		double previous_frame_time = previous_time;
+		int step_count = 0;
 
 		while (!glfwWindowShouldClose(window))
 		{
-			// step sim and render particles
-			sph.step_particles();
+			// wait until fewer than the allowed frames are queued on the GPU
+			pacer.begin_frame();
+
+			// run the substeps owed since the last frame, all in one submission
+			double frame_time = glfwGetTime();
+			scheduler.report_gpu_ms(sph.last_simulation_gpu_ms());
+			// the dam is only drawn until the simulation programs have linked
+			int substeps = sph.programs_ready() ? scheduler.begin_frame(frame_time - previous_frame_time, sph.time_step()) : 0;
+			previous_frame_time = frame_time;
+
+			for (int step = 0; step < substeps; step++)
+				sph.step_particles();
+			step_count += substeps;
+
 			sph.render();
 			frame_count++;
 
@@ -95,16 +444,49 @@ int main(int argc, char** argv)
 			gltDrawText2D(sim_info_text, 10, 10, 1.0f);
 			gltEndDraw();
 
+			pacer.end_frame();
+
 			double current_time = glfwGetTime();
 
 			// one second elapsed
 			if (current_time - previous_time >= 1.0)
 			{
 				ss_text_info = std::stringstream();
-				ss_text_info << "FPS: " << frame_count << "\nParticles: " << sph.particle_count();
+				ss_text_info << std::fixed << std::setprecision(2)
+					<< "FPS: " << frame_count
+					<< "\nCPU submit: " << pacer.cpu_submit_ms() << " ms"
+					<< "\nGPU complete: " << pacer.gpu_complete_ms() << " ms"
+					<< "\nParticles: " << sph.particle_count()
+					<< "\nNeighbours: " << sph.neighbour_search_name()
+					<< (sph.get_specialized_constants() ? " (specialized)" : "")
+					<< "\nSubsteps: " << scheduler.last_substeps() << " (max " << scheduler.max_substeps()
+					<< (scheduler.is_adaptive() ? ", adaptive)" : ")")
+					<< "\nTime step: " << sph.time_step() * 1000.0 << " ms" << (sph.get_adaptive_time_step() ? " (adaptive)" : "")
+					<< "\nSim speed: " << step_count * sph.time_step() / (current_time - previous_time) << " s/s"
+					<< "\nGPU passes (ms):";
+				if (sph.get_sort_interval() > 0)
+				{
+					sph_sim::sort_stats sort = sph.get_sort_stats();
+					ss_text_info << "\n  Morton sort: " << sort.sort_ms << " every " << sph.get_sort_interval() << " steps"
+						<< ", density+forces " << sort.unsorted_neighbour_ms << " -> " << sort.sorted_neighbour_ms;
+				}
+				for (int pass = 0; pass < pass_timer.pass_count(); pass++)
+					ss_text_info << "\n  " << pass_timer.pass_name(pass) << ": " << pass_timer.average_ms(pass);
 				gltSetText(sim_info_text, ss_text_info.str().c_str());
 
+				if (timing_csv.is_open())
+				{
+					timing_csv << current_time << "," << frame_count << "," << step_count << "," << sph.particle_count()
+						<< "," << pacer.cpu_submit_ms() << "," << pacer.gpu_complete_ms();
+					for (int pass = 0; pass < pass_timer.pass_count(); pass++)
+						timing_csv << "," << pass_timer.average_ms(pass);
+					timing_csv << endl;
+				}
+
 				frame_count = 0;
+				step_count = 0;
+				pacer.reset_stats();
+				pass_timer.reset_stats();
 				previous_time = current_time;
 			}
 
@@ -0,0 +1,299 @@
+#include "sdf_boundary.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+#include "exception.h"
+
+sdf_boundary::sdf_boundary(float width, float height, float cell_size)
+{
+	m_size[0] = width;
+	m_size[1] = height;
+	// whole texels that span the domain exactly, so texture coordinates are x / size
+	m_texels[0] = static_cast<int>(std::ceil(width / cell_size));
+	m_texels[1] = static_cast<int>(std::ceil(height / cell_size));
+	m_cell_size[0] = width / m_texels[0];
+	m_cell_size[1] = height / m_texels[1];
+	m_image_size[0] = 0;
+	m_image_size[1] = 0;
+}
+
+void sdf_boundary::add_circle(float x, float y, float radius)
+{
+	if (radius <= 0.f)
+		throw unrecoverable_except("Obstacle circle radius must be positive");
+
+	shape s = { shape::circle, { x, y, radius, 0.f } };
+	m_shapes.push_back(s);
+}
+
+void sdf_boundary::add_box(float x0, float y0, float x1, float y1)
+{
+	shape s = { shape::box, { std::min(x0, x1), std::min(y0, y1), std::max(x0, x1), std::max(y0, y1) } };
+	m_shapes.push_back(s);
+}
+
+void sdf_boundary::load(const std::string& path)
+{
+	const std::string extension = ".pgm";
+	if (path.size() >= extension.size() && path.compare(path.size() - extension.size(), extension.size(), extension) == 0)
+		load_image(path);
+	else
+		load_shapes(path);
+}
+
+void sdf_boundary::load_shapes(const std::string& path)
+{
+	std::ifstream file(path.c_str());
+	if (!file)
+		throw unrecoverable_except("Failed to open obstacle file " + path);
+
+	std::string line;
+	for (int line_number = 1; std::getline(file, line); line_number++)
+	{
+		line = line.substr(0, line.find('#'));
+		std::istringstream ss(line);
+		std::string kind;
+		if (!(ss >> kind))
+			continue;
+
+		float a[4];
+		if (kind == "circle" && ss >> a[0] >> a[1] >> a[2])
+			add_circle(a[0], a[1], a[2]);
+		else if (kind == "box" && ss >> a[0] >> a[1] >> a[2] >> a[3])
+			add_box(a[0], a[1], a[2], a[3]);
+		else
+			throw unrecoverable_except(path + ":" + std::to_string(line_number) + ": expected \"circle x y radius\" or \"box x0 y0 x1 y1\"");
+	}
+}
+
+// Header fields of a PGM are separated by whitespace and # comments.
+static bool read_pgm_field(std::istream& in, int& value)
+{
+	in >> std::ws;
+	while (in.peek() == '#')
+	{
+		in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+		in >> std::ws;
+	}
+	return static_cast<bool>(in >> value);
+}
+
+void sdf_boundary::load_image(const std::string& path)
+{
+	std::ifstream file(path.c_str(), std::ios::binary);
+	if (!file)
+		throw unrecoverable_except("Failed to open obstacle image " + path);
+
+	std::string magic;
+	int width = 0, height = 0, max_value = 0;
+	file >> magic;
+	if ((magic != "P5" && magic != "P2") || !read_pgm_field(file, width) || !read_pgm_field(file, height)
+		|| !read_pgm_field(file, max_value) || width <= 0 || height <= 0 || max_value <= 0 || max_value > 65535)
+		throw unrecoverable_except("Obstacle image " + path + " is not a PGM image");
+
+	m_image_solid.resize(static_cast<size_t>(width) * height);
+	const bool wide = max_value > 255;
+	if (magic == "P5")
+		file.get();	// the single whitespace ending the header
+	for (size_t i = 0; i < m_image_solid.size(); i++)
+	{
+		int value = 0;
+		if (magic == "P2")
+			file >> value;
+		else if (wide)
+		{
+			value = file.get() << 8;
+			value |= file.get();
+		}
+		else
+			value = file.get();
+		if (!file)
+			throw unrecoverable_except("Obstacle image " + path + " is truncated");
+
+		m_image_solid[i] = 2 * value < max_value;
+	}
+	m_image_size[0] = width;
+	m_image_size[1] = height;
+}
+
+float sdf_boundary::shape_distance(const shape& s, float x, float y) const
+{
+	if (s.kind == shape::circle)
+		return std::hypot(x - s.a[0], y - s.a[1]) - s.a[2];
+
+	// box: Euclidean outside, distance to the nearest side (negated) inside
+	const float dx = std::max(s.a[0] - x, x - s.a[2]);
+	const float dy = std::max(s.a[1] - y, y - s.a[3]);
+	return std::hypot(std::max(dx, 0.f), std::max(dy, 0.f)) + std::min(std::max(dx, dy), 0.f);
+}
+
+// Felzenszwalb and Huttenlocher's squared distance transform of samples f
+// spaced spacing apart: d[q] = min over p of (spacing (q - p))^2 + f[p].
+static void distance_transform_1d(const std::vector<float>& f, std::vector<float>& d, float spacing)
+{
+	const int n = static_cast<int>(f.size());
+	const float inf = std::numeric_limits<float>::infinity();
+	// lower envelope of the parabolas rooted at the finite samples
+	std::vector<int> v(n);
+	std::vector<float> z(n + 1);
+	auto intersection = [&](int q, int p)
+	{
+		const float pq = q * spacing, pp = p * spacing;
+		return ((f[q] + pq * pq) - (f[p] + pp * pp)) / (2.f * (pq - pp));
+	};
+	int k = -1;
+	for (int q = 0; q < n; q++)
+	{
+		if (f[q] == inf)
+			continue;
+		if (k < 0)
+		{
+			k = 0;
+			v[0] = q;
+			z[0] = -inf;
+			z[1] = inf;
+			continue;
+		}
+
+		float s = intersection(q, v[k]);
+		while (s <= z[k])
+			s = intersection(q, v[--k]);
+		k++;
+		v[k] = q;
+		z[k] = s;
+		z[k + 1] = inf;
+	}
+
+	d.assign(n, inf);
+	if (k < 0)
+		return;
+	k = 0;
+	for (int q = 0; q < n; q++)
+	{
+		while (z[k + 1] < q * spacing)
+			k++;
+		const float offset = (q - v[k]) * spacing;
+		d[q] = offset * offset + f[v[k]];
+	}
+}
+
+// Squared distance from every texel to the nearest feature texel.
+static std::vector<float> distance_transform_2d(const std::vector<bool>& feature, const int texels[2], const float cell_size[2])
+{
+	const float inf = std::numeric_limits<float>::infinity();
+	std::vector<float> dist(feature.size());
+	for (size_t i = 0; i < feature.size(); i++)
+		dist[i] = feature[i] ? 0.f : inf;
+
+	std::vector<float> f, d;
+	for (int x = 0; x < texels[0]; x++)
+	{
+		f.resize(texels[1]);
+		for (int y = 0; y < texels[1]; y++)
+			f[y] = dist[y * texels[0] + x];
+		distance_transform_1d(f, d, cell_size[1]);
+		for (int y = 0; y < texels[1]; y++)
+			dist[y * texels[0] + x] = d[y];
+	}
+	for (int y = 0; y < texels[1]; y++)
+	{
+		f.assign(dist.begin() + y * texels[0], dist.begin() + (y + 1) * texels[0]);
+		distance_transform_1d(f, d, cell_size[0]);
+		std::copy(d.begin(), d.end(), dist.begin() + y * texels[0]);
+	}
+	return dist;
+}
+
+void sdf_boundary::add_image_distance(std::vector<float>& dist) const
+{
+	// Nearest image pixel at every texel centre, the image's top row is the top of the domain.
+	std::vector<bool> solid(dist.size()), open(dist.size());
+	for (int y = 0; y < m_texels[1]; y++)
+		for (int x = 0; x < m_texels[0]; x++)
+		{
+			const int px = std::min(static_cast<int>((x + 0.5f) * m_image_size[0] / m_texels[0]), m_image_size[0] - 1);
+			const int py = std::min(static_cast<int>((m_texels[1] - y - 0.5f) * m_image_size[1] / m_texels[1]), m_image_size[1] - 1);
+			const size_t texel = static_cast<size_t>(y) * m_texels[0] + x;
+			solid[texel] = m_image_solid[static_cast<size_t>(py) * m_image_size[0] + px] != 0;
+			open[texel] = !solid[texel];
+		}
+
+	// The surface lies half a texel between a solid texel and an open one.
+	const std::vector<float> to_solid = distance_transform_2d(solid, m_texels, m_cell_size);
+	const std::vector<float> to_open = distance_transform_2d(open, m_texels, m_cell_size);
+	const float half_cell = 0.5f * std::min(m_cell_size[0], m_cell_size[1]);
+	for (size_t i = 0; i < dist.size(); i++)
+	{
+		const float image_dist = solid[i] ? half_cell - std::sqrt(to_open[i]) : std::sqrt(to_solid[i]) - half_cell;
+		dist[i] = std::min(dist[i], image_dist);
+	}
+}
+
+void sdf_boundary::bake()
+{
+	const size_t texel_count = static_cast<size_t>(m_texels[0]) * m_texels[1];
+	std::vector<float> dist(texel_count);
+	for (int y = 0; y < m_texels[1]; y++)
+		for (int x = 0; x < m_texels[0]; x++)
+		{
+			const float px = (x + 0.5f) * m_cell_size[0];
+			const float py = (y + 0.5f) * m_cell_size[1];
+			float d = std::min(std::min(px, m_size[0] - px), std::min(py, m_size[1] - py));
+			for (const shape& s : m_shapes)
+				d = std::min(d, shape_distance(s, px, py));
+			dist[static_cast<size_t>(y) * m_texels[0] + x] = d;
+		}
+
+	if (!m_image_solid.empty())
+		add_image_distance(dist);
+
+	// Normals from central differences, one sided at the edges. Where the
+	// gradient vanishes, on a ridge between two surfaces, the normal stays zero.
+	m_texel_data.resize(texel_count * 3);
+	for (int y = 0; y < m_texels[1]; y++)
+		for (int x = 0; x < m_texels[0]; x++)
+		{
+			const int x0 = std::max(x - 1, 0), x1 = std::min(x + 1, m_texels[0] - 1);
+			const int y0 = std::max(y - 1, 0), y1 = std::min(y + 1, m_texels[1] - 1);
+			const float gx = (dist[y * m_texels[0] + x1] - dist[y * m_texels[0] + x0]) / ((x1 - x0) * m_cell_size[0]);
+			const float gy = (dist[y1 * m_texels[0] + x] - dist[y0 * m_texels[0] + x]) / ((y1 - y0) * m_cell_size[1]);
+			const float length = std::hypot(gx, gy);
+
+			float* texel = &m_texel_data[(static_cast<size_t>(y) * m_texels[0] + x) * 3];
+			texel[0] = dist[y * m_texels[0] + x];
+			texel[1] = length > 0.f ? gx / length : 0.f;
+			texel[2] = length > 0.f ? gy / length : 0.f;
+		}
+}
+
+float sdf_boundary::distance(float x, float y) const
+{
+	float normal[2];
+	float d;
+	sample(x, y, d, normal);
+	return d;
+}
+
+void sdf_boundary::sample(float x, float y, float& distance, float normal[2]) const
+{
+	// GL_LINEAR with GL_CLAMP_TO_EDGE around the texel centres
+	const float tx = std::min(std::max(x / m_cell_size[0] - 0.5f, 0.f), static_cast<float>(m_texels[0] - 1));
+	const float ty = std::min(std::max(y / m_cell_size[1] - 0.5f, 0.f), static_cast<float>(m_texels[1] - 1));
+	const int x0 = std::min(static_cast<int>(tx), m_texels[0] - 2 < 0 ? 0 : m_texels[0] - 2);
+	const int y0 = std::min(static_cast<int>(ty), m_texels[1] - 2 < 0 ? 0 : m_texels[1] - 2);
+	const int x1 = std::min(x0 + 1, m_texels[0] - 1), y1 = std::min(y0 + 1, m_texels[1] - 1);
+	const float fx = tx - x0, fy = ty - y0;
+
+	float* channels[3] = { &distance, &normal[0], &normal[1] };
+	for (int c = 0; c < 3; c++)
+	{
+		auto at = [this, c](int x, int y) { return m_texel_data[(static_cast<size_t>(y) * m_texels[0] + x) * 3 + c]; };
+		const float bottom = at(x0, y0) + fx * (at(x1, y0) - at(x0, y0));
+		const float top = at(x0, y1) + fx * (at(x1, y1) - at(x0, y1));
+		*channels[c] = bottom + fy * (top - bottom);
+	}
+}
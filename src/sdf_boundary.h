@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Static solids baked into a signed distance field over the simulation domain:
+// the distance to the nearest solid surface, positive in the open and negative
+// inside a solid, with the domain walls counted as solids. Every texel also
+// holds the unit normal pointing away from that surface, so a single bilinear
+// sample gives a particle both how deep it is and which way is out.
+class sdf_boundary
+{
+public:
+	// The field covers width x height at texels about cell_size wide.
+	sdf_boundary(float width, float height, float cell_size);
+
+	void add_circle(float x, float y, float radius);
+	void add_box(float x0, float y0, float x1, float y1);
+
+	// A .pgm image (binary or ASCII) stretched over the domain, dark pixels are
+	// solid, or else a shape list of "circle x y radius" and "box x0 y0 x1 y1"
+	// lines in simulation units, # starts a comment.
+	void load(const std::string& path);
+
+	bool has_obstacles() const { return !m_shapes.empty() || !m_image_solid.empty(); }
+
+	// Bakes the walls, shapes and image into the texels.
+	void bake();
+
+	// Bilinearly sampled distance, as the GPU sees it.
+	float distance(float x, float y) const;
+	// The same for the distance and the normal, which comes out unnormalised.
+	void sample(float x, float y, float& distance, float normal[2]) const;
+
+	int texels_x() const { return m_texels[0]; }
+	int texels_y() const { return m_texels[1]; }
+	// Distance, normal x and normal y of each texel, rows from the bottom up.
+	const std::vector<float>& texels() const { return m_texel_data; }
+
+private:
+	struct shape
+	{
+		enum kind_type { circle, box } kind;
+		float a[4];	// centre and radius, or lower left and upper right corners
+	};
+
+	void load_shapes(const std::string& path);
+	void load_image(const std::string& path);
+	float shape_distance(const shape& s, float x, float y) const;
+	void add_image_distance(std::vector<float>& dist) const;
+
+	float m_size[2];
+	int m_texels[2];
+	float m_cell_size[2];
+
+	std::vector<shape> m_shapes;
+	int m_image_size[2];
+	std::vector<unsigned char> m_image_solid;	// one per pixel, rows from the top down as stored
+
+	std::vector<float> m_texel_data;
+};
@@ -1,31 +1,81 @@
 #include "sph_sim.h"
+#include <sstream>
+#include <iomanip>
+
+const GLuint sph_sim::MAX_PARTICLES;
+const GLuint sph_sim::MIN_CAPACITY;
 
 
 sph_sim::sph_sim(GLsizei window_size[2]) :
+	SLEEP_SPEED(150.f),
+	SLEEP_DENSITY_CHANGE(0.005f),
+
 	m_window_size{ window_size[0], window_size[1] },
-	boundary_size(800, 800),
 
-	next_free_particle_index(0),
+	m_neighbour_search(neighbour_search::grid),
+	m_local_size(128),
+	m_specialized_constants(false),
+
+	solver_params_dirty(true),
+
+	grid_pass(m_pass_timer.add_pass("grid")),
+	density_pass(m_pass_timer.add_pass("density")),
+	forces_pass(m_pass_timer.add_pass("forces")),
+	integrate_pass(m_pass_timer.add_pass("integrate")),
+	timestep_pass(m_pass_timer.add_pass("timestep")),
+	sleep_pass(m_pass_timer.add_pass("sleep")),
+	emit_pass(m_pass_timer.add_pass("emit")),
+	compact_pass(m_pass_timer.add_pass("compact")),
+	sort_pass(m_pass_timer.add_pass("sort")),
+	unsorted_neighbour_pass(m_pass_timer.add_pass("pre-sort density+forces")),
+	sorted_neighbour_pass(m_pass_timer.add_pass("post-sort density+forces")),
+	draw_pass(m_pass_timer.add_pass("draw")),
+
+	m_particle_count(0),
+	m_capacity(0),
+	m_counted_slots(0),
+	m_emission_bound(0),
+	m_counted_emission_bound(0),
+	m_requested_emission_bound(0),
 
-	particles(MAX_PARTICLES),
+	count_readback_fence(0),
 
-	G(0.0f, G_SCALE * /*-9.8f*/-6),
+	m_nozzle_count(0),
+	m_nozzle_step_bound(0),
+	m_sink_count(0),
 
-	REST_DENS(1000.f),
-	GAS_CONST(2000.f),
-	H(16.f),
-	HSQ(H*H),
-	MASS(65.f),
-	VISC(250.f),
-	DT(/*0.0008f*/0.00087f),
+	state_readback_interval(0),
+	steps_since_readback(0),
+	dropped_readbacks(0),
+	m_step_count(0),
+
+	compact_interval(256),
+	steps_since_compact(0),
+
+	sort_interval(128),
+	steps_since_sort(0),
+
+	m_sleeping(false)
+{
+	grid_size[0] = static_cast<GLint>(ceil(boundary_size[0] / H));
+	grid_size[1] = static_cast<GLint>(ceil(boundary_size[1] / H));
+	grid_cell_count = grid_size[0] * grid_size[1];
 
-	POLY6(315.f / (65.f*(float)M_PI*pow(H, 9.f))),
-	SPIKY_GRAD(-45.f / ((float)M_PI*pow(H, 6.f))),
-	VISC_LAP(45.f / ((float)M_PI*pow(H, 6.f))),
+	// Morton codes interleave the grid cell coordinates
+	morton_bits = 0;
+	while ((1 << morton_bits) < std::max(grid_size[0], grid_size[1]))
+		morton_bits++;
+}
 
-	EPS(H),
-	BOUND_DAMPING(-0.5f)
+const char* sph_sim::neighbour_search_name() const
 {
+	switch (m_neighbour_search)
+	{
+	case neighbour_search::grid: return "grid";
+	case neighbour_search::brute_force: return "brute force";
+	case neighbour_search::brute_force_tiled: return "tiled brute force";
+	}
+	return "unknown";
 }
 
 void sph_sim::draw_particles()
@@ -37,10 +87,28 @@ void sph_sim::draw_particles()
 	glEnable(GL_PROGRAM_POINT_SIZE);
 
 	glBindVertexArray(particles_vao);
-	glBindBuffer(GL_ARRAY_BUFFER, particles_vbo);
-	glUniform2f(particle_vs_boundary_size_unif, boundary_size[0], boundary_size[1]);
-	glDrawArrays(GL_POINTS, 0, next_free_particle_index);
-	glFinish();
+	glBindVertexBuffer(pos_attrib_binding, particle_bufs.x, 0, 2 * sizeof(GLfloat));
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, particle_active_buf_bind, particle_bufs.active);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, dispatch_buf);
+	glDrawArraysIndirect(GL_POINTS, (const GLvoid*)offsetof(dispatch_state, draw_count));
+}
+
+void sph_sim::draw_obstacles()
+{
+	// one triangle covering the window, the fragment shader keeps the solid texels
+	draw_obstacles_sha.use();
+	glViewport(0, 0, m_window_size[0], m_window_size[1]);
+	glBindVertexArray(particles_vao);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+double sph_sim::last_simulation_gpu_ms() const
+{
+	double ms = 0.0;
+	for (int pass = 0; pass < m_pass_timer.pass_count(); pass++)
+		if (pass != draw_pass)
+			ms += m_pass_timer.last_frame_ms(pass);
+	return ms;
 }
 
 void sph_sim::render()
@@ -48,138 +116,1007 @@ void sph_sim::render()
 	glClearColor(0.9f, 0.9f, 0.9f, 1);
 	glClear(GL_COLOR_BUFFER_BIT);
 
+	m_pass_timer.begin(draw_pass);
+	if (m_boundary.has_obstacles())
+		draw_obstacles();
 	draw_particles();
+	m_pass_timer.end();
+
+	m_pass_timer.end_frame();
+}
+
+void sph_sim::build_grid()
+{
+	// Counting sort of the particles into cells: count, scan the counts into
+	// start offsets, then scatter the particle indices into their cell ranges.
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, grid_cell_start_buf);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, grid_cell_start_buf_bind, grid_cell_start_buf);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, grid_particle_cell_buf_bind, grid_particle_cell_buf);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, grid_sorted_index_buf_bind, grid_sorted_index_buf);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, scan_buf_bind, grid_cell_start_buf);
+
+	grid_count_sha.use();
+	glDispatchComputeIndirect(0);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	scan_sha.use();
+	glUniform1ui(scan_element_count_unif, grid_cell_count + 1);
+	glDispatchCompute(1, 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	grid_scatter_sha.use();
+	glDispatchComputeIndirect(0);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void sph_sim::add_solver_constants(gl_shader& sha) const
+{
+	if (!m_specialized_constants)
+		return;
+
+	// Nine significant digits round trip a float exactly, the exponent keeps it a float literal.
+	auto literal = [](float value)
+	{
+		std::ostringstream ss;
+		ss << std::scientific << std::setprecision(8) << value;
+		return ss.str();
+	};
+
+	sha.add_define("SPECIALIZED");
+	sha.add_define("SPECIALIZED_H", literal(H));
+	sha.add_define("SPECIALIZED_HSQ", literal(HSQ));
+	sha.add_define("SPECIALIZED_MASS", literal(MASS));
+	sha.add_define("SPECIALIZED_POLY6", literal(POLY6));
+	sha.add_define("SPECIALIZED_SPIKY_GRAD", literal(SPIKY_GRAD));
+	sha.add_define("SPECIALIZED_VISC_LAP", literal(VISC_LAP));
+	sha.add_define("SPECIALIZED_REST_DENS", literal(REST_DENS));
+	sha.add_define("SPECIALIZED_GAS_CONST", literal(GAS_CONST));
+}
+
+void sph_sim::add_sleep_defines(gl_shader& sha) const
+{
+	if (!m_sleeping)
+		return;
+
+	sha.add_define("SLEEPING");
+	sha.add_define("SLEEP_SPEED", std::to_string(SLEEP_SPEED));
+	sha.add_define("SLEEP_DENSITY_CHANGE", std::to_string(SLEEP_DENSITY_CHANGE));
+	sha.add_define("SLEEP_STEPS", std::to_string(SLEEP_STEPS) + "u");
+}
+
+void sph_sim::bind_particle_buffers()
+{
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, particle_x_buf_bind, particle_bufs.x);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, particle_v_buf_bind, particle_bufs.v);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, particle_f_buf_bind, particle_bufs.f);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, particle_rho_p_buf_bind, particle_bufs.rho_p);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, particle_active_buf_bind, particle_bufs.active);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, dispatch_buf_bind, dispatch_buf);
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, dispatch_buf);
+}
+
+void sph_sim::bind_packed_particle_buffers()
+{
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, packed_particle_x_buf_bind, packed_particle_bufs.x);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, packed_particle_v_buf_bind, packed_particle_bufs.v);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, packed_particle_f_buf_bind, packed_particle_bufs.f);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, packed_particle_rho_p_buf_bind, packed_particle_bufs.rho_p);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, packed_particle_active_buf_bind, packed_particle_bufs.active);
+}
+
+void sph_sim::update_dispatch(bool trim_free_slots)
+{
+	// Recompute the indirect arguments from the (grown) particle count on the GPU.
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, dispatch_buf_bind, dispatch_buf);
+	update_dispatch_sha.use();
+	glUniform1i(update_dispatch_trim_free_slots_unif, trim_free_slots);
+	glUniform1ui(update_dispatch_max_particles_unif, m_capacity);
+	glDispatchCompute(1, 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+}
+
+void sph_sim::request_particle_count()
+{
+	if (count_readback_fence)
+		return;
+
+	glBindBuffer(GL_COPY_READ_BUFFER, dispatch_buf);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, count_readback_buf);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, offsetof(dispatch_state, particle_count), 0, sizeof(GLuint));
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, offsetof(dispatch_state, free_count), sizeof(GLuint) + sizeof(GLfloat), sizeof(GLuint));
+	glBindBuffer(GL_COPY_READ_BUFFER, timestep_buf);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, offsetof(timestep_state, dt), sizeof(GLuint), sizeof(GLfloat));
+	count_readback_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	m_requested_emission_bound = m_emission_bound;
+}
+
+void sph_sim::poll_particle_count()
+{
+	if (!count_readback_fence)
+		return;
+
+	if (glClientWaitSync(count_readback_fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+		return;
+
+	glDeleteSync(count_readback_fence);
+	count_readback_fence = 0;
+
+	GLuint count = 0, free_count = 0;
+	glBindBuffer(GL_COPY_READ_BUFFER, count_readback_buf);
+	glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(GLuint), &count);
+	glGetBufferSubData(GL_COPY_READ_BUFFER, sizeof(GLuint), sizeof(GLfloat), &m_time_step);
+	glGetBufferSubData(GL_COPY_READ_BUFFER, sizeof(GLuint) + sizeof(GLfloat), sizeof(GLuint), &free_count);
+	m_particle_count = static_cast<int>(count - free_count);
+	m_counted_slots = count;
+	m_counted_emission_bound = m_requested_emission_bound;
+}
+
+void sph_sim::set_state_readback(int steps, particle_snapshot_callback callback)
+{
+	state_readback_interval = steps;
+	state_readback_callback = callback;
+}
+
+void sph_sim::finish_state_readback()
+{
+	// free the slots in flight first, so the last request cannot be dropped
+	glFinish();
+	state_readback.poll();
+	// unless the last step already requested this state
+	if (state_readback_interval == 0 || steps_since_readback > 0)
+		request_state_readback();
+	glFinish();
+	state_readback.poll();
+}
+
+void sph_sim::request_state_readback()
+{
+	// The slot holds the count followed by every field at the current capacity,
+	// as the exact count is only known on the GPU when the copies execute.
+	const GLsizeiptr vec2_size = m_capacity * 2 * sizeof(GLfloat);
+	const GLintptr x_offset = 4 * sizeof(GLuint);
+	const GLintptr v_offset = x_offset + vec2_size;
+	const GLintptr rho_p_offset = v_offset + vec2_size;
+	const GLintptr active_offset = rho_p_offset + vec2_size;
+
+	std::vector<async_readback::copy_range> ranges = {
+		{ dispatch_buf, offsetof(dispatch_state, particle_count), x_offset },
+		{ particle_bufs.x, 0, vec2_size },
+		{ particle_bufs.v, 0, vec2_size },
+		{ particle_bufs.rho_p, 0, vec2_size },
+		{ particle_bufs.active, 0, static_cast<GLsizeiptr>(m_capacity * sizeof(GLint)) }
+	};
+
+	// the copies read what the passes just wrote
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+	const unsigned long step = m_step_count;
+	particle_snapshot_callback callback = state_readback_callback;
+	bool queued = state_readback.request(ranges, [=](const GLubyte* data)
+	{
+		particle_snapshot snapshot;
+		snapshot.step = step;
+		snapshot.count = *reinterpret_cast<const GLuint*>(data);
+		snapshot.x = reinterpret_cast<const GLfloat*>(data + x_offset);
+		snapshot.v = reinterpret_cast<const GLfloat*>(data + v_offset);
+		snapshot.rho_p = reinterpret_cast<const GLfloat*>(data + rho_p_offset);
+		snapshot.active = reinterpret_cast<const GLint*>(data + active_offset);
+		callback(snapshot);
+	});
+
+	if (!queued)
+		dropped_readbacks++;
+}
+
+void sph_sim::update_solver_params()
+{
+	if (!solver_params_dirty)
+		return;
+
+	solver_params params;
+	params.G[0] = G[0];
+	params.G[1] = G[1];
+	params.boundary_size[0] = boundary_size[0];
+	params.boundary_size[1] = boundary_size[1];
+	params.grid_size[0] = grid_size[0];
+	params.grid_size[1] = grid_size[1];
+	params.H = H;
+	params.HSQ = HSQ;
+	params.REST_DENS = REST_DENS;
+	params.GAS_CONST = GAS_CONST;
+	params.MASS = MASS;
+	params.VISC = VISC;
+	params.DT = DT;
+	params.POLY6 = POLY6;
+	params.SPIKY_GRAD = SPIKY_GRAD;
+	params.VISC_LAP = VISC_LAP;
+	params.EPS = EPS;
+	params.BOUND_DAMPING = BOUND_DAMPING;
+
+	glBindBuffer(GL_UNIFORM_BUFFER, solver_params_ubo);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(solver_params), &params);
+	solver_params_dirty = false;
+}
+
+void sph_sim::allocate_scratch_buffers()
+{
+	// Per particle buffers rewritten before every use, so their contents need
+	// not survive a change of capacity.
+	for (GLuint buf : { packed_particle_bufs.x, packed_particle_bufs.v, packed_particle_bufs.f, packed_particle_bufs.rho_p })
+	{
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, buf);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, m_capacity * 2 * sizeof(GLfloat), NULL, GL_DYNAMIC_DRAW);
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, packed_particle_bufs.active);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, m_capacity * sizeof(GLint), NULL, GL_DYNAMIC_DRAW);
+
+	// the compaction offsets have one extra entry for the total
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, compact_offset_buf);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, (m_capacity + 1) * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+
+	// sort buffers, the histogram has one entry per digit and workgroup
+	sort_group_stride = dispatch_size(m_capacity);
+	for (int i = 0; i < 2; i++)
+	{
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, sort_keys_buf[i]);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, m_capacity * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, sort_values_buf[i]);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, m_capacity * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, sort_histogram_buf);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, 16 * sort_group_stride * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+
+	if (m_neighbour_search == neighbour_search::grid)
+	{
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, grid_particle_cell_buf);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, m_capacity * 2 * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, grid_sorted_index_buf);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, m_capacity * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+	}
+}
+
+// Replaces buf with a new buffer of size bytes that starts with the kept bytes of the old one.
+static void grow_buffer(GLuint& buf, GLsizeiptr kept, GLsizeiptr size, GLenum usage)
+{
+	GLuint grown;
+	glGenBuffers(1, &grown);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, grown);
+	glBufferData(GL_COPY_WRITE_BUFFER, size, NULL, usage);
+	glBindBuffer(GL_COPY_READ_BUFFER, buf);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, kept);
+	glDeleteBuffers(1, &buf);
+	buf = grown;
+}
+
+void sph_sim::grow_particle_buffers(GLuint capacity)
+{
+	// The copies run on the GPU in order with the passes before and after
+	// them, so the host never needs the particles or the exact count.
+	const GLuint kept = m_capacity;
+	m_capacity = capacity;
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+	for (GLuint* buf : { &particle_bufs.x, &particle_bufs.v, &particle_bufs.f, &particle_bufs.rho_p })
+		grow_buffer(*buf, kept * 2 * sizeof(GLfloat), capacity * 2 * sizeof(GLfloat), GL_DYNAMIC_DRAW);
+	grow_buffer(particle_bufs.active, kept * sizeof(GLint), capacity * sizeof(GLint), GL_DYNAMIC_DRAW);
+	// the new slots start inactive
+	glClearBufferSubData(GL_COPY_WRITE_BUFFER, GL_R32I, kept * sizeof(GLint), (capacity - kept) * sizeof(GLint), GL_RED_INTEGER, GL_INT, NULL);
+
+	grow_buffer(free_slot_buf, kept * sizeof(GLuint), capacity * sizeof(GLuint), GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, free_slot_buf_bind, free_slot_buf);
+
+	allocate_scratch_buffers();
+	std::cout << "particle capacity grown to " << capacity << std::endl;
+}
+
+void sph_sim::reserve_particles(GLuint added)
+{
+	m_emission_bound += added;
+	const GLuint needed = std::min(used_slot_bound(), MAX_PARTICLES);
+	if (needed <= m_capacity)
+		return;
+
+	GLuint capacity = m_capacity;
+	while (capacity < needed)
+		capacity *= 2;
+	grow_particle_buffers(std::min(capacity, MAX_PARTICLES));
+}
+
+void sph_sim::compact_particles()
+{
+	finish_programs();
+
+	// Scan the active flags into packed slots. Slots past the particle count are
+	// always inactive, so the extra last entry becomes the packed count.
+	glBindBuffer(GL_COPY_READ_BUFFER, particle_bufs.active);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, compact_offset_buf);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, m_capacity * sizeof(GLint));
+	glClearBufferSubData(GL_COPY_WRITE_BUFFER, GL_R32UI, m_capacity * sizeof(GLuint), sizeof(GLuint), GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+
+	// Slots past the packed count must read as inactive after the swap.
+	glBindBuffer(GL_COPY_WRITE_BUFFER, packed_particle_bufs.active);
+	glClearBufferData(GL_COPY_WRITE_BUFFER, GL_R32I, GL_RED_INTEGER, GL_INT, NULL);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, scan_buf_bind, compact_offset_buf);
+	scan_sha.use();
+	glUniform1ui(scan_element_count_unif, m_capacity + 1);
+	glDispatchCompute(1, 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+	bind_particle_buffers();
+	bind_packed_particle_buffers();
+
+	compact_sha.use();
+	glDispatchComputeIndirect(0);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+	std::swap(particle_bufs, packed_particle_bufs);
+
+	// The packed count becomes the live count without a round trip to the host.
+	glBindBuffer(GL_COPY_READ_BUFFER, compact_offset_buf);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, dispatch_buf);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, m_capacity * sizeof(GLuint), offsetof(dispatch_state, particle_count), sizeof(GLuint));
+	// no slot below the packed count is free any more
+	glClearBufferSubData(GL_COPY_WRITE_BUFFER, GL_R32UI, offsetof(dispatch_state, free_count), sizeof(GLuint), GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+	update_dispatch();
+}
+
+void sph_sim::sort_particles()
+{
+	finish_programs();
+
+	bind_particle_buffers();
+
+	// Morton key and index of every particle, inactive ones sort to the end.
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, sort_keys_out_buf_bind, sort_keys_buf[0]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, sort_values_out_buf_bind, sort_values_buf[0]);
+	sort_keys_sha.use();
+	glUniform1ui(sort_keys_morton_bits_unif, morton_bits);
+	glDispatchComputeIndirect(0);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, scan_buf_bind, sort_histogram_buf);
+
+	// One stable counting sort pass per 4 bit digit: count, scan the counts into offsets, scatter.
+	const GLuint key_bits = 2 * morton_bits + 1;
+	int src = 0;
+	for (GLuint shift = 0; shift < key_bits; shift += 4)
+	{
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, sort_keys_in_buf_bind, sort_keys_buf[src]);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, sort_values_in_buf_bind, sort_values_buf[src]);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, sort_keys_out_buf_bind, sort_keys_buf[1 - src]);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, sort_values_out_buf_bind, sort_values_buf[1 - src]);
+
+		// Workgroups past the current count never write their entries, and the
+		// previous pass left scanned offsets in them.
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, sort_histogram_buf);
+		glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+
+		sort_histogram_sha.use();
+		glUniform1ui(sort_histogram_digit_shift_unif, shift);
+		glUniform1ui(sort_histogram_group_stride_unif, sort_group_stride);
+		glDispatchComputeIndirect(0);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+		scan_sha.use();
+		glUniform1ui(scan_element_count_unif, 16 * sort_group_stride);
+		glDispatchCompute(1, 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+		sort_scatter_sha.use();
+		glUniform1ui(sort_scatter_digit_shift_unif, shift);
+		glUniform1ui(sort_scatter_group_stride_unif, sort_group_stride);
+		glDispatchComputeIndirect(0);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+		src = 1 - src;
+	}
+
+	// Gather the particles into the spare set in sorted order and swap, like compaction.
+	glBindBuffer(GL_COPY_WRITE_BUFFER, packed_particle_bufs.active);
+	glClearBufferData(GL_COPY_WRITE_BUFFER, GL_R32I, GL_RED_INTEGER, GL_INT, NULL);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, sort_values_in_buf_bind, sort_values_buf[src]);
+	bind_packed_particle_buffers();
+	reorder_sha.use();
+	glDispatchComputeIndirect(0);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+	std::swap(particle_bufs, packed_particle_bufs);
+
+	// Inactive particles sort last, so the free slots now end the live range.
+	update_dispatch(true);
+}
+
+sph_sim::sort_stats sph_sim::get_sort_stats() const
+{
+	sort_stats stats;
+	stats.sort_ms = m_pass_timer.average_sample_ms(sort_pass);
+	stats.unsorted_neighbour_ms = m_pass_timer.average_sample_ms(unsorted_neighbour_pass);
+	stats.sorted_neighbour_ms = m_pass_timer.average_sample_ms(sorted_neighbour_pass);
+	return stats;
 }
 
 void sph_sim::step_particles()
 {
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, particle_index_buf_bind, particles_vbo);
+	// Keep drawing the dam until the simulation programs have linked.
+	if (!programs_ready())
+		return;
+
+	poll_particle_count();
+	if (state_readback_callback)
+		state_readback.poll();
+	update_solver_params();
+
+	if (compact_interval > 0 && ++steps_since_compact >= compact_interval)
+	{
+		m_pass_timer.begin(compact_pass);
+		compact_particles();
+		m_pass_timer.end();
+		steps_since_compact = 0;
+	}
 
+	// Time density and forces on either side of a sort to show what it gains.
+	int neighbour_pass = -1;
+	if (sort_interval > 0)
+	{
+		if (++steps_since_sort >= sort_interval)
+		{
+			m_pass_timer.begin(sort_pass);
+			sort_particles();
+			m_pass_timer.end();
+			steps_since_sort = 0;
+			neighbour_pass = sorted_neighbour_pass;
+		}
+		else if (steps_since_sort + 1 >= sort_interval)
+			neighbour_pass = unsorted_neighbour_pass;
+	}
+
+	if (m_nozzle_count > 0)
+	{
+		m_pass_timer.begin(emit_pass);
+		emit_nozzles();
+		m_pass_timer.end();
+	}
+
+	bind_particle_buffers();
+
+	if (m_neighbour_search == neighbour_search::grid)
+	{
+		m_pass_timer.begin(grid_pass);
+		build_grid();
+		m_pass_timer.end();
+	}
+
+	if (neighbour_pass >= 0)
+		m_pass_timer.begin(neighbour_pass);
+	else
+		m_pass_timer.begin(density_pass);
 	density_pressure_sha.use();
-	glUniform1f(density_pressure_H_unif, H);
-	glUniform1f(density_pressure_REST_DENS_unif, REST_DENS);
-	glUniform1f(density_pressure_GAS_CONST_unif, GAS_CONST);
-	glUniform1f(density_pressure_MASS_unif, MASS);
-	glUniform1f(density_pressure_POLY6_unif, POLY6);
-	glDispatchCompute(next_free_particle_index, 1, 1);
-	glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+	glDispatchComputeIndirect(0);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
 
+	if (neighbour_pass < 0)
+	{
+		m_pass_timer.end();
+		m_pass_timer.begin(forces_pass);
+	}
 	forces_sha.use();
-	glUniform2f(forces_G_unif, G[0], G[1]);
-	glUniform1f(forces_H_unif, H);
-	glUniform1f(forces_MASS_unif, MASS);
-	glUniform1f(forces_VISC_unif, VISC);
-	glUniform1f(forces_SPIKY_GRAD_unif, SPIKY_GRAD);
-	glUniform1f(forces_VISC_LAP_unif, VISC_LAP);
-	glDispatchCompute(next_free_particle_index, 1, 1);
-	glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+	glDispatchComputeIndirect(0);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+	m_pass_timer.end();
 
+	if (m_adaptive_time_step)
+	{
+		// Reduce max |v| and max |f|/rho, then turn them into the dt this step integrates with.
+		m_pass_timer.begin(timestep_pass);
+		timestep_reduce_sha.use();
+		glDispatchComputeIndirect(0);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+		timestep_sha.use();
+		glUniform1f(timestep_cfl_number_unif, CFL_NUMBER);
+		glUniform1f(timestep_force_number_unif, FORCE_NUMBER);
+		glUniform1f(timestep_dt_min_unif, DT_MIN);
+		glUniform1f(timestep_dt_max_unif, DT_MAX);
+		glDispatchCompute(1, 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+		m_pass_timer.end();
+	}
+
+	m_pass_timer.begin(integrate_pass);
 	integrate_sha.use();
-	glUniform2f(integrate_boundary_size_unif, boundary_size[0], boundary_size[1]);
-	glUniform1f(integrate_DT_unif, DT);
-	glUniform1f(integrate_H_unif, H);
-	glUniform1f(integrate_BOUND_DAMPING_unif, BOUND_DAMPING);
-	glDispatchCompute(next_free_particle_index, 1, 1);
-	glMemoryBarrier(GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+	glUniform1ui(integrate_sink_count_unif, m_sink_count);
+	glDispatchComputeIndirect(0);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+	m_pass_timer.end();
+
+	if (m_sleeping)
+	{
+		// wake the cells disturbed this step and age the calm ones
+		m_pass_timer.begin(sleep_pass);
+		sleep_sha.use();
+		glUniform1ui(sleep_cell_count_unif, grid_cell_count);
+		glDispatchCompute(dispatch_size(grid_cell_count), 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		m_pass_timer.end();
+	}
+
+	m_step_count++;
+	if (state_readback_interval > 0 && ++steps_since_readback >= state_readback_interval)
+	{
+		request_state_readback();
+		steps_since_readback = 0;
+	}
+
+	request_particle_count();
 }
 
 void sph_sim::init_particles()
 {
-	for (auto& p : particles)
-		p = Particle(0.0f, 0.0f, 0.0f, 0.0f, false);
+	// Create initial dam of particles. It is emitted once the programs are
+	// submitted, its lattice sizes the particle buffers.
+	const emitter_state dam_state = make_emitter_state(dam_emitter());
+	m_capacity = std::min(std::max(dam_state.columns * dam_state.rows, MIN_CAPACITY), MAX_PARTICLES);
 
-	// Create initial dam of particles.
-	for (float y = H; y < boundary_size[1] - EPS*2.f; y += H)
-		for (float x = EPS; x <= boundary_size[0] / 2; x += H)
-			if (next_free_particle_index < DAM_PARTICLES)
-			{
-				float jitter = static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
-				particles[next_free_particle_index++] = Particle(x + jitter, y, true);
-			}
+	m_boundary.bake();
+	glGenTextures(1, &boundary_sdf_tex);
+	glActiveTexture(GL_TEXTURE0 + boundary_sdf_unit);
+	glBindTexture(GL_TEXTURE_2D, boundary_sdf_tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, m_boundary.texels_x(), m_boundary.texels_y(), 0, GL_RGB, GL_FLOAT, m_boundary.texels().data());
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glActiveTexture(GL_TEXTURE0);
 
 	// particle's vao
 	glGenVertexArrays(1, &particles_vao);
 	glBindVertexArray(particles_vao);
 
-	// particle buffer
-	glGenBuffers(1, &particles_vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, particles_vbo);
-	glBufferData(GL_ARRAY_BUFFER, particles.size() * sizeof(Particle), particles.data(), GL_DYNAMIC_DRAW);
+	// particle buffers at capacity, the spare set for compaction is scratch
+	for (GLuint* buf : { &particle_bufs.x, &particle_bufs.v, &particle_bufs.f, &particle_bufs.rho_p })
+	{
+		glGenBuffers(1, buf);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, *buf);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, m_capacity * 2 * sizeof(GLfloat), NULL, GL_DYNAMIC_DRAW);
+	}
+	glGenBuffers(1, &particle_bufs.active);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, particle_bufs.active);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, m_capacity * sizeof(GLint), NULL, GL_DYNAMIC_DRAW);
+	for (GLuint* buf : { &packed_particle_bufs.x, &packed_particle_bufs.v, &packed_particle_bufs.f, &packed_particle_bufs.rho_p, &packed_particle_bufs.active })
+		glGenBuffers(1, buf);
+	glGenBuffers(1, &compact_offset_buf);
+
+	// solver parameters, bound once for every program and filled by update_solver_params()
+	glGenBuffers(1, &solver_params_ubo);
+	glBindBuffer(GL_UNIFORM_BUFFER, solver_params_ubo);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(solver_params), NULL, GL_DYNAMIC_DRAW);
+	glBindBufferBase(GL_UNIFORM_BUFFER, solver_params_ubo_bind, solver_params_ubo);
+	update_solver_params();
+
+	// dispatch state starts empty, update_dispatch() after the dam's emitter adds it
+	dispatch_state initial_dispatch = {};
+	glGenBuffers(1, &dispatch_buf);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, dispatch_buf);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(dispatch_state), &initial_dispatch, GL_DYNAMIC_COPY);
+
+	glGenBuffers(1, &count_readback_buf);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, count_readback_buf);
+	glBufferData(GL_COPY_WRITE_BUFFER, 2 * sizeof(GLuint) + sizeof(GLfloat), NULL, GL_STREAM_READ);
+
+	// every step starts at DT, the adaptive pass rewrites it after the forces
+	timestep_state initial_timestep = { DT, 0, 0 };
+	glGenBuffers(1, &timestep_buf);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, timestep_buf);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(timestep_state), &initial_timestep, GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, timestep_buf_bind, timestep_buf);
+	m_time_step = DT;
+
+	// emitter descriptors, a few bytes each instead of the particles they spawn
+	glGenBuffers(1, &emitter_buf);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, emitter_buf);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(emitter_state), NULL, GL_DYNAMIC_COPY);
+	glGenBuffers(1, &nozzle_buf);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, nozzle_buf);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, MAX_NOZZLES * sizeof(emitter_state), NULL, GL_DYNAMIC_COPY);
+	descriptor_staging.init(sizeof(emitter_state), DESCRIPTOR_STAGING_SLOTS);
+
+	// sinks, and the slots of the particles they removed, bound for good
+	glGenBuffers(1, &sink_buf);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, sink_buf);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, MAX_SINKS * sizeof(sink_state), NULL, GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, sink_buf_bind, sink_buf);
+	glGenBuffers(1, &free_slot_buf);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, free_slot_buf);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, m_capacity * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, free_slot_buf_bind, free_slot_buf);
+
+	// State readback slots, the count padded to 16 bytes then each field. Slots
+	// may still be in flight when the capacity grows, so they hold the most.
+	if (state_readback_callback)
+		state_readback.init(4 * sizeof(GLuint) + MAX_PARTICLES * (3 * 2 * sizeof(GLfloat) + sizeof(GLint)), STATE_READBACK_SLOTS);
+
+	// every slot starts inactive, the emitters fill them on the GPU
+	for (GLuint buf : { particle_bufs.x, particle_bufs.v, particle_bufs.f, particle_bufs.rho_p, particle_bufs.active })
+	{
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, buf);
+		glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+	}
+
+	const bool use_grid = m_neighbour_search == neighbour_search::grid;
+	if (m_sleeping && !use_grid)
+	{
+		std::cout << "particle sleeping needs the grid neighbour search, disabled" << std::endl;
+		m_sleeping = false;
+	}
+
+	GLint max_local_size = 0;
+	glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 0, &max_local_size);
+	if (m_local_size == 0 || m_local_size > static_cast<GLuint>(max_local_size))
+		throw unrecoverable_except("Unsupported compute workgroup size");
+
+	const std::string local_size = std::to_string(m_local_size);
+	std::cout << "compute workgroup size: " << m_local_size << std::endl;
+
+	glGenBuffers(2, sort_keys_buf);
+	glGenBuffers(2, sort_values_buf);
+	glGenBuffers(1, &sort_histogram_buf);
+
+	if (use_grid)
+	{
+		// grid buffers, the cell start buffer has one extra entry for the total
+		glGenBuffers(1, &grid_cell_start_buf);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, grid_cell_start_buf);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, (grid_cell_count + 1) * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+
+		glGenBuffers(1, &grid_particle_cell_buf);
+		glGenBuffers(1, &grid_sorted_index_buf);
+	}
 
-	// Add attributes/uniforms and initialise the shader.
+	if (m_sleeping)
+	{
+		// every cell starts awake
+		glGenBuffers(1, &cell_sleep_buf);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, cell_sleep_buf);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, grid_cell_count * 2 * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+		glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, cell_sleep_buf_bind, cell_sleep_buf);
+	}
+
+	allocate_scratch_buffers();
+
+	// Submit every program before checking any of them, so the driver can
+	// compile and link them in parallel.
 	draw_particles_sha.add_attribute("position");
-	draw_particles_sha.add_uniform("boundary_size");
-	draw_particles_sha.init_vs_fs_from_file("shaders/particle_vs.glsl", "shaders/particle_fs.glsl");
+	draw_particles_sha.submit_vs_fs_from_file("shaders/particle_vs.glsl", "shaders/particle_fs.glsl");
+	if (m_boundary.has_obstacles())
+		draw_obstacles_sha.submit_vs_fs_from_file("shaders/obstacle_vs.glsl", "shaders/obstacle_fs.glsl");
+
+	update_dispatch_sha.add_define("LOCAL_SIZE", local_size);
+	update_dispatch_sha.add_uniform("max_particles");
+	update_dispatch_sha.add_uniform("trim_free_slots");
+	update_dispatch_sha.submit_cs_from_file("shaders/sph_update_dispatch_cs.glsl");
+
+	for (gl_shader* sha : { &emit_sha, &emit_nozzle_sha })
+	{
+		sha->add_define("LOCAL_SIZE", local_size);
+		add_sleep_defines(*sha);
+		sha->add_uniform("max_particles");
+	}
+	emit_nozzle_sha.add_define("NOZZLE");
+	emit_sha.submit_cs_from_file("shaders/sph_emit_cs.glsl");
+	emit_nozzle_sha.submit_cs_from_file("shaders/sph_emit_cs.glsl");
+
+	scan_sha.add_uniform("element_count");
+	scan_sha.submit_cs_from_file("shaders/sph_scan_cs.glsl");
+
+	compact_sha.add_define("LOCAL_SIZE", local_size);
+	compact_sha.submit_cs_from_file("shaders/sph_compact_cs.glsl");
+
+	sort_keys_sha.add_define("LOCAL_SIZE", local_size);
+	add_solver_constants(sort_keys_sha);
+	sort_keys_sha.add_uniform("morton_bits");
+	sort_keys_sha.submit_cs_from_file("shaders/sph_sort_keys_cs.glsl");
+
+	sort_histogram_sha.add_define("LOCAL_SIZE", local_size);
+	sort_histogram_sha.add_uniform("digit_shift");
+	sort_histogram_sha.add_uniform("group_stride");
+	sort_histogram_sha.submit_cs_from_file("shaders/sph_sort_histogram_cs.glsl");
+
+	sort_scatter_sha.add_define("LOCAL_SIZE", local_size);
+	sort_scatter_sha.add_uniform("digit_shift");
+	sort_scatter_sha.add_uniform("group_stride");
+	sort_scatter_sha.submit_cs_from_file("shaders/sph_sort_scatter_cs.glsl");
+
+	reorder_sha.add_define("LOCAL_SIZE", local_size);
+	reorder_sha.submit_cs_from_file("shaders/sph_reorder_cs.glsl");
+
+	if (use_grid)
+	{
+		grid_count_sha.add_define("LOCAL_SIZE", local_size);
+		add_solver_constants(grid_count_sha);
+		grid_count_sha.submit_cs_from_file("shaders/sph_grid_count_cs.glsl");
+
+		grid_scatter_sha.add_define("LOCAL_SIZE", local_size);
+		grid_scatter_sha.submit_cs_from_file("shaders/sph_grid_scatter_cs.glsl");
+	}
+
+	density_pressure_sha.add_define("LOCAL_SIZE", local_size);
+	add_solver_constants(density_pressure_sha);
+	add_sleep_defines(density_pressure_sha);
+	if (use_grid)
+		density_pressure_sha.add_define("NEIGHBOUR_GRID");
+	else if (m_neighbour_search == neighbour_search::brute_force_tiled)
+		density_pressure_sha.add_define("NEIGHBOUR_TILED");
+	density_pressure_sha.submit_cs_from_file("shaders/sph_density_pressure_cs.glsl");
+
+	forces_sha.add_define("LOCAL_SIZE", local_size);
+	add_solver_constants(forces_sha);
+	add_sleep_defines(forces_sha);
+	if (use_grid)
+		forces_sha.add_define("NEIGHBOUR_GRID");
+	else if (m_neighbour_search == neighbour_search::brute_force_tiled)
+		forces_sha.add_define("NEIGHBOUR_TILED");
+	forces_sha.submit_cs_from_file("shaders/sph_forces_cs.glsl");
+
+	integrate_sha.add_define("LOCAL_SIZE", local_size);
+	add_sleep_defines(integrate_sha);
+	integrate_sha.add_uniform("sink_count");
+	integrate_sha.submit_cs_from_file("shaders/sph_integrate_cs.glsl");
+
+	if (m_sleeping)
+	{
+		sleep_sha.add_define("LOCAL_SIZE", local_size);
+		add_sleep_defines(sleep_sha);
+		sleep_sha.add_uniform("cell_count");
+		sleep_sha.submit_cs_from_file("shaders/sph_sleep_cs.glsl");
+	}
+
+	if (m_adaptive_time_step)
+	{
+		timestep_reduce_sha.add_define("LOCAL_SIZE", local_size);
+		timestep_reduce_sha.submit_cs_from_file("shaders/sph_timestep_reduce_cs.glsl");
+
+		timestep_sha.add_uniform("cfl_number");
+		timestep_sha.add_uniform("force_number");
+		timestep_sha.add_uniform("dt_min");
+		timestep_sha.add_uniform("dt_max");
+		timestep_sha.submit_cs_from_file("shaders/sph_timestep_cs.glsl");
+	}
+
+	// Drawing and spawning are needed for the first frame, the rest finish in
+	// the background and the simulation starts once they are all ready.
+	draw_particles_sha.finish();
+	if (m_boundary.has_obstacles())
+		draw_obstacles_sha.finish();
+	update_dispatch_sha.finish();
+	emit_sha.finish();
+	emit_nozzle_sha.finish();
+
+	pending_programs = { &scan_sha, &compact_sha, &sort_keys_sha, &sort_histogram_sha, &sort_scatter_sha,
+		&reorder_sha, &density_pressure_sha, &forces_sha, &integrate_sha };
+	if (use_grid)
+	{
+		pending_programs.push_back(&grid_count_sha);
+		pending_programs.push_back(&grid_scatter_sha);
+	}
+	if (m_sleeping)
+		pending_programs.push_back(&sleep_sha);
+	if (m_adaptive_time_step)
+	{
+		pending_programs.push_back(&timestep_reduce_sha);
+		pending_programs.push_back(&timestep_sha);
+	}
 
 	// After initialization the attribute/uniform locations can be retrieved.
 	GLuint pos_attrib = draw_particles_sha.get_attribute("position");
-	particle_vs_boundary_size_unif = draw_particles_sha.get_uniform("boundary_size");
 
 	// Position attribute.
-	glBindBuffer(GL_ARRAY_BUFFER, particles_vbo);
-	glVertexAttribPointer(pos_attrib, 2, GL_FLOAT, GL_FALSE, sizeof(Particle), (GLvoid*)0);
+	// The buffer is attached when drawing as compaction swaps the position buffer.
+	glVertexAttribFormat(pos_attrib, 2, GL_FLOAT, GL_FALSE, 0);
+	glVertexAttribBinding(pos_attrib, pos_attrib_binding);
 	glEnableVertexAttribArray(pos_attrib);
 
-	density_pressure_sha.add_uniform("H");
-	density_pressure_sha.add_uniform("REST_DENS");
-	density_pressure_sha.add_uniform("GAS_CONST");
-	density_pressure_sha.add_uniform("MASS");
-	density_pressure_sha.add_uniform("POLY6");
-	density_pressure_sha.init_cs_from_file("shaders/sph_density_pressure_cs.glsl");
-	density_pressure_H_unif = density_pressure_sha.get_uniform("H");
-	density_pressure_REST_DENS_unif = density_pressure_sha.get_uniform("REST_DENS");
-	density_pressure_GAS_CONST_unif = density_pressure_sha.get_uniform("GAS_CONST");
-	density_pressure_MASS_unif = density_pressure_sha.get_uniform("MASS");
-	density_pressure_POLY6_unif = density_pressure_sha.get_uniform("POLY6");
-
-	forces_sha.add_uniform("H");
-	forces_sha.add_uniform("G");
-	forces_sha.add_uniform("MASS");
-	forces_sha.add_uniform("VISC");
-	forces_sha.add_uniform("SPIKY_GRAD");
-	forces_sha.add_uniform("VISC_LAP");
-	forces_sha.init_cs_from_file("shaders/sph_forces_cs.glsl");
-	forces_H_unif = forces_sha.get_uniform("H");
-	forces_G_unif = forces_sha.get_uniform("G");
-	forces_MASS_unif = forces_sha.get_uniform("MASS");
-	forces_VISC_unif = forces_sha.get_uniform("VISC");
-	forces_SPIKY_GRAD_unif = forces_sha.get_uniform("SPIKY_GRAD");
-	forces_VISC_LAP_unif = forces_sha.get_uniform("VISC_LAP");
-
-	integrate_sha.add_uniform("boundary_size");
-	integrate_sha.add_uniform("DT");
-	integrate_sha.add_uniform("H");
-	integrate_sha.add_uniform("BOUND_DAMPING");
-	integrate_sha.init_cs_from_file("shaders/sph_integrate_cs.glsl");
-	integrate_boundary_size_unif = integrate_sha.get_uniform("boundary_size");
-	integrate_DT_unif = integrate_sha.get_uniform("DT");
-	integrate_H_unif = integrate_sha.get_uniform("H");
-	integrate_BOUND_DAMPING_unif = integrate_sha.get_uniform("BOUND_DAMPING");
+	update_dispatch_max_particles_unif = update_dispatch_sha.get_uniform("max_particles");
+	update_dispatch_trim_free_slots_unif = update_dispatch_sha.get_uniform("trim_free_slots");
+	emit_max_particles_unif = emit_sha.get_uniform("max_particles");
+	emit_nozzle_max_particles_unif = emit_nozzle_sha.get_uniform("max_particles");
+
+	emit(dam_state);
+	request_particle_count();
 }
 
-void sph_sim::add_particle_block()
+bool sph_sim::programs_ready()
 {
-	if (next_free_particle_index >= MAX_PARTICLES)
-		std::cout << "maximum number of particles reached" << std::endl;
-	else
+	for (gl_shader* program : pending_programs)
+		if (!program->is_ready())
+			return false;
+
+	finish_programs();
+	return true;
+}
+
+void sph_sim::finish_programs()
+{
+	if (pending_programs.empty())
+		return;
+
+	for (gl_shader* program : pending_programs)
+		program->finish();
+	pending_programs.clear();
+
+	scan_element_count_unif = scan_sha.get_uniform("element_count");
+	sort_keys_morton_bits_unif = sort_keys_sha.get_uniform("morton_bits");
+	sort_histogram_digit_shift_unif = sort_histogram_sha.get_uniform("digit_shift");
+	sort_histogram_group_stride_unif = sort_histogram_sha.get_uniform("group_stride");
+	sort_scatter_digit_shift_unif = sort_scatter_sha.get_uniform("digit_shift");
+	sort_scatter_group_stride_unif = sort_scatter_sha.get_uniform("group_stride");
+	integrate_sink_count_unif = integrate_sha.get_uniform("sink_count");
+
+	if (m_sleeping)
+		sleep_cell_count_unif = sleep_sha.get_uniform("cell_count");
+
+	if (m_adaptive_time_step)
+	{
+		timestep_cfl_number_unif = timestep_sha.get_uniform("cfl_number");
+		timestep_force_number_unif = timestep_sha.get_uniform("force_number");
+		timestep_dt_min_unif = timestep_sha.get_uniform("dt_min");
+		timestep_dt_max_unif = timestep_sha.get_uniform("dt_max");
+	}
+}
+
+sph_sim::emitter_state sph_sim::make_emitter_state(const emitter& e) const
+{
+	emitter_state state = {};
+	state.shape = static_cast<GLint>(e.shape);
+	emitter_lattice(e, state.columns, state.rows);
+	state.seed = static_cast<GLuint>(rand());
+	std::copy(e.origin, e.origin + 2, state.origin);
+	std::copy(e.size, e.size + 2, state.size);
+	std::copy(e.velocity, e.velocity + 2, state.velocity);
+	state.spacing = e.spacing;
+	state.jitter = e.jitter;
+	state.rate = e.rate;
+	return state;
+}
+
+void sph_sim::emit(const emitter& e)
+{
+	if (e.shape == emitter_shape::nozzle)
+		throw unrecoverable_except("Nozzles are added with add_nozzle()");
+
+	emit(make_emitter_state(e));
+}
+
+void sph_sim::emit(const emitter_state& state)
+{
+	// New particles take slots off the free list or are appended past the count
+	// on the GPU, so the host never needs to know where the live range ends. Only the
+	// descriptor is uploaded, through a mapped staging slot.
+	reserve_particles(state.columns * state.rows);
+	*static_cast<emitter_state*>(descriptor_staging.begin_write()) = state;
+	descriptor_staging.end_write(emitter_buf, 0, sizeof(emitter_state));
+
+	bind_particle_buffers();
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, dispatch_buf_bind, dispatch_buf);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, emitter_buf_bind, emitter_buf);
+	emit_sha.use();
+	glUniform1ui(emit_max_particles_unif, m_capacity);
+	glDispatchCompute(dispatch_size(state.columns * state.rows), 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+	update_dispatch();
+}
+
+void sph_sim::add_nozzle(const emitter& e)
+{
+	if (e.shape != emitter_shape::nozzle)
+		throw unrecoverable_except("Only nozzles can be added with add_nozzle()");
+	if (m_nozzle_count >= MAX_NOZZLES)
+	{
+		std::cout << "maximum number of nozzles reached" << std::endl;
+		return;
+	}
+
+	*static_cast<emitter_state*>(descriptor_staging.begin_write()) = make_emitter_state(e);
+	descriptor_staging.end_write(nozzle_buf, m_nozzle_count * sizeof(emitter_state), sizeof(emitter_state));
+	m_nozzle_count++;
+	// the carried over fraction adds at most one particle to a step
+	m_nozzle_step_bound += static_cast<GLuint>(std::ceil(e.rate * DT_MAX)) + 1;
+}
+
+void sph_sim::clear_nozzles()
+{
+	m_nozzle_count = 0;
+	m_nozzle_step_bound = 0;
+}
+
+void sph_sim::toggle_nozzle()
+{
+	if (m_nozzle_count > 0)
 	{
-		std::vector<Particle> particle_block;
-		unsigned int placed = 0;
-		for (float y = boundary_size[1] / 1.5f - boundary_size[1] / 5.f; y < boundary_size[1] / 1.5f + boundary_size[1] / 5.f; y += H*0.95f)
-			for (float x = boundary_size[0] / 2.f - boundary_size[1] / 5.f; x <= boundary_size[0] / 2.f + boundary_size[1] / 5.f; x += H*0.95f)
-				if (placed < BLOCK_PARTICLES && (next_free_particle_index + placed) <= MAX_PARTICLES)
-				{
-					float jitter = static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
-					particle_block.push_back(Particle(x + jitter, y + jitter, 1));
-					placed++;
-				}
+		clear_nozzles();
+		return;
+	}
 
-		glBindVertexArray(particles_vao);
-		glBindBuffer(GL_ARRAY_BUFFER, particles_vbo);
-		glBufferSubData(GL_ARRAY_BUFFER, next_free_particle_index * sizeof(Particle), placed * sizeof(Particle), particle_block.data());
+	// five rows across, one row per spacing the fluid moves
+	const float spacing = H*0.95f;
+	const float speed = 500.f;
+	emitter nozzle = {
+		emitter_shape::nozzle,
+		{ boundary_size[0] - EPS*2.f, boundary_size[1] * 0.7f },
+		{ spacing * 4.f, 0.f },
+		{ -speed, 0.f },
+		spacing, 1.f, 5.f * speed / spacing };
+	add_nozzle(nozzle);
+}
 
-		next_free_particle_index += placed;
+void sph_sim::add_sink(const sink& s)
+{
+	if (s.shape == emitter_shape::nozzle)
+		throw unrecoverable_except("Sinks are boxes or discs");
+	if (m_sink_count >= MAX_SINKS)
+	{
+		std::cout << "maximum number of sinks reached" << std::endl;
+		return;
 	}
+
+	sink_state state = {};
+	state.shape = static_cast<GLint>(s.shape);
+	state.origin[0] = s.origin[0];
+	state.origin[1] = s.origin[1];
+	state.size[0] = s.size[0];
+	state.size[1] = s.size[1];
+	*static_cast<sink_state*>(descriptor_staging.begin_write()) = state;
+	descriptor_staging.end_write(sink_buf, m_sink_count * sizeof(sink_state), sizeof(sink_state));
+	m_sink_count++;
+}
+
+void sph_sim::clear_sinks()
+{
+	m_sink_count = 0;
+}
+
+void sph_sim::toggle_drain()
+{
+	if (m_sink_count > 0)
+	{
+		clear_sinks();
+		return;
+	}
+
+	const float width = boundary_size[0] * 0.15f;
+	sink drain = {
+		emitter_shape::box,
+		{ boundary_size[0] - width, 0.f },
+		{ width, H*4.f } };
+	add_sink(drain);
+}
+
+void sph_sim::emit_nozzles()
+{
+	reserve_particles(m_nozzle_step_bound);
+	bind_particle_buffers();
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, dispatch_buf_bind, dispatch_buf);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, emitter_buf_bind, nozzle_buf);
+	emit_nozzle_sha.use();
+	glUniform1ui(emit_nozzle_max_particles_unif, m_capacity);
+	glDispatchCompute(m_nozzle_count, 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+	update_dispatch();
+}
+
+void sph_sim::add_particle_block()
+{
+	if (static_cast<GLuint>(m_particle_count) >= MAX_PARTICLES)
+		std::cout << "maximum number of particles reached" << std::endl;
+	else
+		emit(block_emitter());
 }
 
 void sph_sim::resize_window(GLsizei window_size[2])
@@ -2,6 +2,10 @@
 
 #include <GL/glew.h>
 #include <vector>
+#include <utility>
+#include <cstddef>
+#include <functional>
+#include <algorithm>
 
 #define _USE_MATH_DEFINES
 #include <math.h>
@@ -10,6 +14,11 @@
 
 #include "exception.h"
 #include "gl_shader.h"
+#include "gpu_timer.h"
+#include "staging_ring.h"
+#include "async_readback.h"
+#include "sdf_boundary.h"
+#include "sph_solver.h"
 
 #define GLT_MANUAL_VIEWPORT
 #define GLT_IMPLEMENTATION
@@ -21,117 +30,415 @@ using namespace std;
 using namespace Eigen;
 
 
-struct Particle
+// Particles entering a sink are retired, their slots go on a free list on the
+// GPU that later emitters fill first.
+struct sink
 {
-	Particle() :
-		x{ 0.0f, 0.0f },
-		v{ 0.0f, 0.0f },
-		f{ 0.0f, 0.0f },
-		rho(0.0f),
-		p(0.0f),
-		active(0) {}
-
-	Particle(float posx, float posy, bool activate) :
-		x{ posx, posy },
-		v{ 0.0f, 0.0f },
-		f{ 0.0f, 0.0f },
-		rho(0.0f),
-		p(0.0f),
-		active(activate ? 1 : 0) {}
-
-	Particle(float posx, float posy, float velx, float vely, bool activate) :
-		x{ posx, posy },
-		v{ velx, vely },
-		f{ 0.0f, 0.0f },
-		rho(0.0f),
-		p(0.0f),
-		active(activate ? 1 : 0) {}
-
-	float x[2];		// position
-	float v[2];		// velocity
-	float f[2];		// force
-	float rho;		// density
-	float p;		// pressure
-	int active;
-	int pad;
+	emitter_shape shape;	// box or disc, laid out as for an emitter
+	float origin[2];
+	float size[2];
 };
 
-class sph_sim
+// Solver parameters as laid out in the std140 SolverParams uniform block.
+struct solver_params
+{
+	GLfloat G[2];
+	GLfloat boundary_size[2];
+	GLint grid_size[2];
+	GLfloat H;
+	GLfloat HSQ;
+	GLfloat REST_DENS;
+	GLfloat GAS_CONST;
+	GLfloat MASS;
+	GLfloat VISC;
+	GLfloat DT;
+	GLfloat POLY6;
+	GLfloat SPIKY_GRAD;
+	GLfloat VISC_LAP;
+	GLfloat EPS;
+	GLfloat BOUND_DAMPING;
+};
+
+// How the density and force passes find the neighbours of a particle.
+enum class neighbour_search
+{
+	grid,			// bin particles into H sized cells and visit the 3x3 block around each particle
+	brute_force,	// test every particle against every other particle
+	brute_force_tiled	// all pairs, staging blocks of neighbours in workgroup shared memory
+};
+
+// The OpenGL 4.3 compute backend, every step runs as compute passes over
+// particle buffers that never leave the GPU.
+class sph_sim : public sph_solver
 {
 public:
 	sph_sim(GLsizei window_size[2]);
 
+	const char* backend_name() const override { return "OpenGL compute"; }
+
+	// Must be selected before init_particles() as it picks the compute shader variants.
+	void set_neighbour_search(neighbour_search mode) { m_neighbour_search = mode; }
+	neighbour_search get_neighbour_search() const { return m_neighbour_search; }
+	const char* neighbour_search_name() const;
+
+	// Invocations per compute workgroup, must be selected before init_particles().
+	void set_local_size(GLuint local_size) { m_local_size = local_size; }
+	GLuint get_local_size() const { return m_local_size; }
+
+	// Compile the constant solver parameters into the neighbour shaders as literals
+	// instead of reading them from the uniform buffer. Must be selected before init_particles().
+	void set_specialized_constants(bool specialized) { m_specialized_constants = specialized; }
+	bool get_specialized_constants() const { return m_specialized_constants; }
+
 	void render();
-	void init_particles();
-	void step_particles();
+	void init_particles() override;
+	void step_particles() override;
+
+	// Programs are compiled in parallel, steps are skipped until they have all
+	// linked. programs_ready() never blocks, finish_programs() waits for them.
+	bool programs_ready();
+	void finish_programs();
+
+	// Spawn the lattice of a box or disc emitter, positions inside a solid are skipped.
+	void emit(const emitter& e);
+	// Nozzles emit at the start of every step until cleared.
+	void add_nozzle(const emitter& e);
+	void clear_nozzles();
+	int nozzle_count() const { return m_nozzle_count; }
+	// Starts or stops a nozzle spraying in from the right wall.
+	void toggle_nozzle();
+
+	void add_sink(const sink& s);
+	void clear_sinks();
+	int sink_count() const { return m_sink_count; }
+	// Opens or closes a drain in the bottom right corner.
+	void toggle_drain();
+
+	// Last particle count read back from the GPU, it may lag a frame or two behind.
+	int particle_count() const override { return m_particle_count; }
+
+	// Pack active particles to the front every N steps, 0 disables it.
+	void set_compact_interval(int steps) { compact_interval = steps; }
+	void compact_particles();
+
+	// Reorder the particles along a Morton curve every N steps, 0 disables it.
+	void set_sort_interval(int steps) { sort_interval = steps; }
+	int get_sort_interval() const { return sort_interval; }
+	void sort_particles();
 
-	int particle_count() const { return next_free_particle_index; }
+	// GPU cost of one sort, and the density plus forces time of the steps
+	// just before and just after a sort, averaged since the last reset.
+	struct sort_stats
+	{
+		double sort_ms;
+		double unsorted_neighbour_ms;
+		double sorted_neighbour_ms;
+	};
+	sort_stats get_sort_stats() const;
 
-	void add_particle_block();
+	void add_particle_block() override;
+
+	// The state is read back without stalling, the callback runs from a later
+	// step_particles() once the copy is done.
+	void set_state_readback(int steps, particle_snapshot_callback callback) override;
+	// Stalls until the copies are done.
+	void finish_state_readback() override;
+	// Samples skipped because every readback buffer was still in flight.
+	int dropped_state_readbacks() const { return dropped_readbacks; }
 
 	void resize_window(GLsizei window_size[2]);
 
+	// GPU time of each simulation and draw pass, collected once per render().
+	gpu_timer& pass_timer() { return m_pass_timer; }
+	// GPU time of all simulation passes in the last collected frame.
+	double last_simulation_gpu_ms() const;
+
+	// Skip the density, force and integrate work of grid cells whose particles have
+	// stayed calm for a while, until moving fluid reaches them again. Only the grid
+	// neighbour search supports it. Must be selected before init_particles().
+	void set_sleeping(bool sleeping) { m_sleeping = sleeping; }
+	bool get_sleeping() const { return m_sleeping; }
+
+	// Simulated seconds advanced by one step_particles(), read back from the GPU
+	// alongside the particle count so it may lag a frame or two behind.
+	float time_step() const override { return m_time_step; }
+
 private:
 	void draw_particles();
+	void draw_obstacles();
+	void build_grid();
+	void bind_particle_buffers();
+	void bind_packed_particle_buffers();
+	// Trimming drops the free slots off the end of the live range, which is
+	// only correct right after a sort has moved them there.
+	void update_dispatch(bool trim_free_slots = false);
+	void request_particle_count();
+	void poll_particle_count();
+	void update_solver_params();
+	void request_state_readback();
+	GLuint dispatch_size(GLuint invocations) const { return (invocations + m_local_size - 1) / m_local_size; }
+	void add_solver_constants(gl_shader& sha) const;
+	void add_sleep_defines(gl_shader& sha) const;
 
-	const static int MAX_PARTICLES = 256 * 256;
-	const static int BLOCK_PARTICLES = 32 * 32;
-	const static int DAM_PARTICLES = 150 * 150;
+	// Particle buffers start at what the initial dam needs and double, copied on
+	// the GPU, whenever the emitters could outgrow them, up to MAX_PARTICLES.
+	const static GLuint MAX_PARTICLES = 256 * 256;
+	const static GLuint MIN_CAPACITY = 1024;
 
-	const float G_SCALE = 12000;
+	// a cell sleeps once no particle in or next to it has been faster than SLEEP_SPEED
+	// or changed density by more than SLEEP_DENSITY_CHANGE for SLEEP_STEPS steps
+	const float SLEEP_SPEED;
+	const float SLEEP_DENSITY_CHANGE;
+	const static int SLEEP_STEPS = 32;
 
-	// solver parameters
-	Vector2f G;	// external (gravitational) forces
-	const float REST_DENS; // rest density
-	const float GAS_CONST; // const for equation of state
-	const float H; // kernel radius
-	const float HSQ; // radius^2 for optimization
-	const float MASS; // assume all particles have the same mass
-	const float VISC; // viscosity constant
-	const float DT; // integration timestep
+	GLsizei m_window_size[2];
 
-	 // smoothing kernels defined in M�ller and their gradients
-	const float POLY6;
-	const float SPIKY_GRAD;
-	const float VISC_LAP;
+	// the boundary's signed distance field, sampled by the integrate pass
+	GLuint boundary_sdf_tex;
+	GLuint boundary_sdf_unit = 1;	// unit 0 belongs to the text overlay
 
-	// simulation parameters
-	const float EPS;	// boundary epsilon
-	const float BOUND_DAMPING;
+	neighbour_search m_neighbour_search;
+	GLuint m_local_size;
+	bool m_specialized_constants;
 
-	GLsizei m_window_size[2];
+	// solver parameters shared by every program through one uniform buffer
+	GLuint solver_params_ubo;
+	GLuint solver_params_ubo_bind = 0;
+	bool solver_params_dirty;	// set when a parameter changes, cleared on upload
+
+	// per pass GPU timing
+	gpu_timer m_pass_timer;
+	const int grid_pass;
+	const int density_pass;
+	const int forces_pass;
+	const int integrate_pass;
+	const int timestep_pass;
+	const int sleep_pass;
+	const int emit_pass;
+	const int compact_pass;
+	const int sort_pass;
+	const int unsorted_neighbour_pass;	// density and forces on the step before a sort
+	const int sorted_neighbour_pass;	// density and forces on the step after a sort
+	const int draw_pass;
+
+	// uniform grid, cells are H wide
+	GLint grid_size[2];
+	GLuint grid_cell_count;
 
-	const Vector2f boundary_size;
-	
-	std::vector<Particle> particles;
-	int next_free_particle_index;
+	int m_particle_count;
+
+	// Slots the GPU may be using, from the last count read back plus every
+	// particle the emitters could have added since it was requested.
+	GLuint used_slot_bound() const { return m_counted_slots + static_cast<GLuint>(m_emission_bound - m_counted_emission_bound); }
+	void reserve_particles(GLuint added);
+	void grow_particle_buffers(GLuint capacity);
+	void allocate_scratch_buffers();
+	GLuint m_capacity;
+	GLuint m_counted_slots;					// live range of the last count read back
+	unsigned long m_emission_bound;			// particles the emitters could have added so far
+	unsigned long m_counted_emission_bound;	// of those, the ones that count saw
+	unsigned long m_requested_emission_bound;	// when the pending count readback was requested
 
 	GLuint particles_vao;
-	GLuint particles_vbo;
+	GLuint pos_attrib_binding = 0;
 
-	GLuint particle_index_buf_bind = 0;
+	// particle state, one buffer per field so each pass only fetches what it uses
+	struct particle_buffers
+	{
+		GLuint x;			// vec2 position, also the vertex buffer for drawing
+		GLuint v;			// vec2 velocity
+		GLuint f;			// vec2 force
+		GLuint rho_p;		// vec2 density and pressure
+		GLuint active;		// int active flag
+	};
 
-	gl_shader draw_particles_sha;
-	GLuint particle_vs_boundary_size_unif;
+	// compaction packs the current buffers into the spare set and swaps them
+	particle_buffers particle_bufs;
+	particle_buffers packed_particle_bufs;
 
-	gl_shader density_pressure_sha;
-	GLuint density_pressure_H_unif;
-	GLuint density_pressure_REST_DENS_unif;
-	GLuint density_pressure_GAS_CONST_unif;
-	GLuint density_pressure_MASS_unif;
-	GLuint density_pressure_POLY6_unif;
+	GLuint particle_x_buf_bind = 0;
+	GLuint particle_v_buf_bind = 1;
+	GLuint particle_f_buf_bind = 2;
+	GLuint particle_rho_p_buf_bind = 3;
+	GLuint particle_active_buf_bind = 4;
+	GLuint packed_particle_x_buf_bind = 9;
+	GLuint packed_particle_v_buf_bind = 10;
+	GLuint packed_particle_f_buf_bind = 11;
+	GLuint packed_particle_rho_p_buf_bind = 12;
+	GLuint packed_particle_active_buf_bind = 13;
 
-	gl_shader forces_sha;
-	GLuint forces_H_unif;
-	GLuint forces_MASS_unif;
-	GLuint forces_G_unif;
-	GLuint forces_VISC_unif;
-	GLuint forces_SPIKY_GRAD_unif;
-	GLuint forces_VISC_LAP_unif;
+	// The live particle count stays on the GPU next to the indirect dispatch and
+	// draw arguments derived from it, so the host never needs it to drive a frame.
+	struct dispatch_state
+	{
+		GLuint num_groups[3];	// DispatchIndirectCommand
+		GLuint particle_count;
+		GLuint draw_count;		// DrawArraysIndirectCommand
+		GLuint draw_instance_count;
+		GLuint draw_first;
+		GLuint draw_base_instance;
+		GLuint spawned_count;	// emitted since the last update_dispatch()
+		GLuint free_count;		// entries on the free slot list
+	};
+
+	GLuint dispatch_buf;
+	GLuint dispatch_buf_bind = 14;
+
+	GLuint count_readback_buf;		// host readable copy of the particle count, time step and free count
+	GLsync count_readback_fence;	// signalled once count_readback_buf holds them
+
+	// The time step never leaves the GPU, the integrate pass reads it from here.
+	struct timestep_state
+	{
+		GLfloat dt;
+		GLuint max_speed_bits;	// maxima of the current step as float bits
+		GLuint max_accel_bits;
+	};
 
+	GLuint timestep_buf;
+	GLuint timestep_buf_bind = 20;
+	float m_time_step;
+
+	gl_shader timestep_reduce_sha;
+	gl_shader timestep_sha;
+	GLuint timestep_cfl_number_unif;
+	GLuint timestep_force_number_unif;
+	GLuint timestep_dt_min_unif;
+	GLuint timestep_dt_max_unif;
+
+	gl_shader update_dispatch_sha;
+	GLuint update_dispatch_max_particles_unif;
+	GLuint update_dispatch_trim_free_slots_unif;
+
+	// Emitter descriptors as laid out in the std430 EmitterBuffer of sph_emit_cs.glsl.
+	struct emitter_state
+	{
+		GLint shape;
+		GLuint columns;		// lattice size, a nozzle has a single row
+		GLuint rows;
+		GLuint seed;		// of the jitter hash
+		GLfloat origin[2];
+		GLfloat size[2];
+		GLfloat velocity[2];
+		GLfloat spacing;
+		GLfloat jitter;
+		GLfloat rate;
+		GLfloat owed;		// nozzle particles carried over to the next step, GPU owned
+		GLuint emitted;		// nozzle particles so far, GPU owned
+		GLuint padding;
+	};
+	emitter_state make_emitter_state(const emitter& e) const;
+	void emit(const emitter_state& state);
+	void emit_nozzles();
+
+	// one box or disc emitter at a time, and every nozzle
+	GLuint emitter_buf;
+	GLuint nozzle_buf;
+	GLuint emitter_buf_bind = 15;
+	staging_ring descriptor_staging;	// persistently mapped, copied into the emitter and sink buffers
+	const static int DESCRIPTOR_STAGING_SLOTS = 4;
+	const static int MAX_NOZZLES = 16;
+	int m_nozzle_count;
+	GLuint m_nozzle_step_bound;	// most particles the nozzles can emit in one step
+
+	gl_shader emit_sha;
+	gl_shader emit_nozzle_sha;
+	GLuint emit_max_particles_unif;
+	GLuint emit_nozzle_max_particles_unif;
+
+	// Sink descriptors as laid out in the std430 SinkBuffer of sph_integrate_cs.glsl.
+	struct sink_state
+	{
+		GLint shape;
+		GLuint padding;
+		GLfloat origin[2];
+		GLfloat size[2];
+	};
+
+	GLuint sink_buf;
+	GLuint sink_buf_bind = 27;
+	const static int MAX_SINKS = 16;
+	int m_sink_count;
+
+	// indices of retired particles, free_count of them are valid
+	GLuint free_slot_buf;
+	GLuint free_slot_buf_bind = 26;
+
+	// asynchronous particle state readback
+	async_readback state_readback;
+	const static int STATE_READBACK_SLOTS = 3;
+	int state_readback_interval;
+	int steps_since_readback;
+	int dropped_readbacks;
+	particle_snapshot_callback state_readback_callback;
+	unsigned long m_step_count;
+
+	// stream compaction of inactive particles
+	GLuint compact_offset_buf;		// active flags, scanned in place into packed slots
+	int compact_interval;
+	int steps_since_compact;
+
+	gl_shader compact_sha;
+
+	// Morton order sorting, an LSD radix sort of 4 bit digits over ping-pong key/value buffers
+	GLuint sort_keys_buf[2];
+	GLuint sort_values_buf[2];		// particle index belonging to each key
+	GLuint sort_histogram_buf;		// digit counts per workgroup, scanned into scatter offsets
+	GLuint sort_group_stride;		// histogram entries per digit, the most workgroups a pass can have
+	GLuint morton_bits;				// bits per axis, enough for the grid
+	int sort_interval;
+	int steps_since_sort;
+
+	GLuint sort_keys_in_buf_bind = 16;
+	GLuint sort_values_in_buf_bind = 17;
+	GLuint sort_keys_out_buf_bind = 18;
+	GLuint sort_values_out_buf_bind = 19;
+
+	gl_shader sort_keys_sha;
+	GLuint sort_keys_morton_bits_unif;
+
+	gl_shader sort_histogram_sha;
+	GLuint sort_histogram_digit_shift_unif;
+	GLuint sort_histogram_group_stride_unif;
+
+	gl_shader sort_scatter_sha;
+	GLuint sort_scatter_digit_shift_unif;
+	GLuint sort_scatter_group_stride_unif;
+
+	gl_shader reorder_sha;
+
+	// grid buffers used by the neighbour search
+	GLuint grid_cell_start_buf;		// cell counts, scanned in place into start offsets
+	GLuint grid_particle_cell_buf;	// cell index and rank within the cell per particle
+	GLuint grid_sorted_index_buf;	// particle indices ordered by cell
+
+	GLuint grid_cell_start_buf_bind = 5;
+	GLuint grid_particle_cell_buf_bind = 6;
+	GLuint grid_sorted_index_buf_bind = 7;
+	GLuint scan_buf_bind = 8;
+
+	bool m_sleeping;
+
+	// per cell calm step count and disturbed flag
+	GLuint cell_sleep_buf;
+	GLuint cell_sleep_buf_bind = 21;
+
+	gl_shader sleep_sha;
+	GLuint sleep_cell_count_unif;
+
+	gl_shader grid_count_sha;
+
+	gl_shader scan_sha;
+	GLuint scan_element_count_unif;
+
+	gl_shader grid_scatter_sha;
+
+	gl_shader draw_particles_sha;
+	gl_shader draw_obstacles_sha;
+	gl_shader density_pressure_sha;
+	gl_shader forces_sha;
 	gl_shader integrate_sha;
-	GLuint integrate_boundary_size_unif;
-	GLuint integrate_DT_unif;
-	GLuint integrate_H_unif;
-	GLuint integrate_BOUND_DAMPING_unif;
+	GLuint integrate_sink_count_unif;
+
+	std::vector<gl_shader*> pending_programs;	// submitted but not yet finished
 };
\ No newline at end of file
@@ -0,0 +1,81 @@
+#include "sph_solver.h"
+
+#include <cmath>
+
+sph_solver::sph_solver() :
+	G(0.0f, G_SCALE * /*-9.8f*/-6),
+
+	REST_DENS(1000.f),
+	GAS_CONST(2000.f),
+	H(16.f),
+	HSQ(H*H),
+	MASS(65.f),
+	VISC(250.f),
+	DT(/*0.0008f*/0.00087f),
+	DT_MIN(DT * 0.1f),
+	DT_MAX(DT * 4.f),
+	CFL_NUMBER(0.4f),
+	FORCE_NUMBER(0.4f),
+
+	POLY6(315.f / (65.f*(float)M_PI*pow(H, 9.f))),
+	SPIKY_GRAD(-45.f / ((float)M_PI*pow(H, 6.f))),
+	VISC_LAP(45.f / ((float)M_PI*pow(H, 6.f))),
+
+	EPS(H),
+	BOUND_DAMPING(-0.5f),
+
+	boundary_size(800, 800),
+	m_boundary(boundary_size[0], boundary_size[1], H / 4.f),
+
+	m_adaptive_time_step(true)
+{
+}
+
+emitter sph_solver::dam_emitter() const
+{
+	emitter dam = {
+		emitter_shape::box,
+		{ EPS, H },
+		{ boundary_size[0] / 2 - EPS, boundary_size[1] - EPS*2.f - H*2.f },
+		{ 0.f, 0.f },
+		H, 1.f, 0.f };
+	return dam;
+}
+
+emitter sph_solver::block_emitter() const
+{
+	emitter block = {
+		emitter_shape::box,
+		{ boundary_size[0] / 2.f - boundary_size[1] / 5.f, boundary_size[1] / 1.5f - boundary_size[1] / 5.f },
+		{ boundary_size[1] * 2.f / 5.f, boundary_size[1] * 2.f / 5.f },
+		{ 0.f, 0.f },
+		H*0.95f, 1.f, 0.f };
+	return block;
+}
+
+void sph_solver::emitter_lattice(const emitter& e, unsigned int& columns, unsigned int& rows) const
+{
+	// Lattice points run from corner to corner, the small slack keeps an exact
+	// multiple of the spacing from losing its last row to rounding.
+	auto points = [&e](float length) { return static_cast<unsigned int>(std::floor(length / e.spacing + 1e-3f)) + 1; };
+	if (e.spacing <= 0.f)
+		throw unrecoverable_except("Emitter spacing must be positive");
+
+	switch (e.shape)
+	{
+	case emitter_shape::box:
+		columns = points(e.size[0]);
+		rows = points(e.size[1]);
+		break;
+	case emitter_shape::disc:
+		columns = 2 * points(e.size[0]) - 1;
+		rows = columns;
+		break;
+	case emitter_shape::nozzle:
+		if (e.velocity[0] == 0.f && e.velocity[1] == 0.f)
+			throw unrecoverable_except("Nozzle velocity must not be zero");
+		columns = points(e.size[0]);
+		rows = 1;
+		break;
+	}
+}
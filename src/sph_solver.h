@@ -0,0 +1,128 @@
+#pragma once
+
+#include <functional>
+#include <string>
+
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+#include <Eigen/Dense>
+
+#include "exception.h"
+#include "sdf_boundary.h"
+
+// Where new particles come from. Emitters are evaluated by a compute shader
+// that writes the particles straight into the particle buffers.
+enum class emitter_shape
+{
+	box,	// a lattice from origin (lower left) to origin + size
+	disc,	// a lattice filling the circle of radius size[0] around origin
+	nozzle	// an opening size[0] wide centred on origin, across velocity
+};
+
+// Box and disc emitters spawn their lattice once, nozzles emit rate particles
+// per simulated second, a row across the opening at a time, until cleared.
+struct emitter
+{
+	emitter_shape shape;
+	float origin[2];
+	float size[2];
+	float velocity[2];	// of every particle spawned
+	float spacing;		// between lattice points, across the opening for a nozzle
+	float jitter;		// random offset along each axis, up to this far
+	float rate;			// nozzle only
+};
+
+// Particle state handed out by a backend, the arrays hold count entries and
+// are only valid inside the callback they are passed to.
+struct particle_snapshot
+{
+	unsigned long step;		// steps completed when the state was captured
+	unsigned int count;		// live particle slots, inactive ones included
+	const float* x;			// positions, 2 floats per particle
+	const float* v;			// velocities, 2 floats per particle
+	const float* rho_p;		// density and pressure per particle
+	const int* active;
+};
+
+typedef std::function<void(const particle_snapshot&)> particle_snapshot_callback;
+
+// The physics every backend solves, the domain, its obstacles and the initial
+// scene, behind the operations a backend implements to advance it. sph_sim
+// runs the steps as OpenGL compute passes, cpu_sph_solver on a thread pool.
+class sph_solver
+{
+public:
+	virtual ~sph_solver() {}
+
+	virtual const char* backend_name() const = 0;
+
+	// Allocate the particle state and emit the initial dam.
+	virtual void init_particles() = 0;
+	virtual void step_particles() = 0;
+	virtual void add_particle_block() = 0;
+
+	// Live particles as last known to the host, a GPU backend may lag a step or two behind.
+	virtual int particle_count() const = 0;
+	// Simulated seconds advanced by one step_particles(), may lag likewise.
+	virtual float time_step() const = 0;
+
+	// Hand the particle state to the callback every N steps. Must be set before
+	// init_particles(), with 0 steps only finish_state_readback() hands it out.
+	virtual void set_state_readback(int steps, particle_snapshot_callback callback) = 0;
+	// Hands the current state, after any still in flight, to the callback
+	// before returning. May stall, meant for the end of a run.
+	virtual void finish_state_readback() = 0;
+
+	// Pick each step's dt from the fastest particle and the largest acceleration
+	// instead of always stepping by DT. Must be selected before init_particles().
+	void set_adaptive_time_step(bool adaptive) { m_adaptive_time_step = adaptive; }
+	bool get_adaptive_time_step() const { return m_adaptive_time_step; }
+
+	// Static obstacles from a shape list or a PGM image (see sdf_boundary),
+	// must be loaded before init_particles().
+	void load_obstacles(const std::string& path) { m_boundary.load(path); }
+	bool has_obstacles() const { return m_boundary.has_obstacles(); }
+
+protected:
+	sph_solver();
+
+	// The dam every run starts from and the block add_particle_block()
+	// drops into the middle of the domain.
+	emitter dam_emitter() const;
+	emitter block_emitter() const;
+	// Lattice points of a box or disc emitter, or across the opening of a nozzle.
+	void emitter_lattice(const emitter& e, unsigned int& columns, unsigned int& rows) const;
+
+	const float G_SCALE = 12000;
+
+	// solver parameters
+	Eigen::Vector2f G;	// external (gravitational) forces
+	const float REST_DENS; // rest density
+	const float GAS_CONST; // const for equation of state
+	const float H; // kernel radius
+	const float HSQ; // radius^2 for optimization
+	const float MASS; // assume all particles have the same mass
+	const float VISC; // viscosity constant
+	const float DT; // integration timestep
+	const float DT_MIN; // adaptive timestep bounds
+	const float DT_MAX;
+	const float CFL_NUMBER; // fraction of H the fastest particle may travel in one step
+	const float FORCE_NUMBER; // same limit for the largest acceleration
+
+	 // smoothing kernels defined in Müller and their gradients
+	const float POLY6;
+	const float SPIKY_GRAD;
+	const float VISC_LAP;
+
+	// simulation parameters
+	const float EPS;	// boundary epsilon
+	const float BOUND_DAMPING;
+
+	const Eigen::Vector2f boundary_size;
+
+	// signed distance to the walls and obstacles
+	sdf_boundary m_boundary;
+
+	bool m_adaptive_time_step;
+};
@@ -0,0 +1,73 @@
+#include "staging_ring.h"
+
+
+staging_ring::staging_ring() :
+	m_buf(0),
+	m_mapping(nullptr),
+	m_slot_size(0),
+	m_slot(0)
+{
+}
+
+staging_ring::~staging_ring()
+{
+	for (GLsync fence : m_slot_fences)
+		if (fence)
+			glDeleteSync(fence);
+
+	if (m_buf)
+	{
+		glBindBuffer(GL_COPY_READ_BUFFER, m_buf);
+		glUnmapBuffer(GL_COPY_READ_BUFFER);
+		glDeleteBuffers(1, &m_buf);
+	}
+}
+
+void staging_ring::init(GLsizeiptr slot_size, int slot_count)
+{
+	const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+	m_slot_size = slot_size;
+	m_slot_fences.assign(slot_count, 0);
+
+	glGenBuffers(1, &m_buf);
+	glBindBuffer(GL_COPY_READ_BUFFER, m_buf);
+	glBufferStorage(GL_COPY_READ_BUFFER, slot_size * slot_count, NULL, flags);
+	m_mapping = static_cast<GLubyte*>(glMapBufferRange(GL_COPY_READ_BUFFER, 0, slot_size * slot_count, flags));
+	if (!m_mapping)
+		throw unrecoverable_except("Could not map the staging buffer");
+}
+
+void* staging_ring::begin_write()
+{
+	GLsync& fence = m_slot_fences[m_slot];
+	if (fence)
+	{
+		// Normally long signalled, the ring is sized to cover the frames in flight.
+		GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+		for (;;)
+		{
+			GLenum result = glClientWaitSync(fence, flags, 1000000000);
+			if (result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED)
+				break;
+			if (result == GL_WAIT_FAILED)
+				throw unrecoverable_except("Waiting for a staging slot failed");
+			flags = 0;
+		}
+		glDeleteSync(fence);
+		fence = 0;
+	}
+
+	return m_mapping + m_slot * m_slot_size;
+}
+
+void staging_ring::end_write(GLuint dst_buf, GLintptr dst_offset, GLsizeiptr size)
+{
+	// The mapping is coherent, so the writes are visible to the copy without a flush.
+	glBindBuffer(GL_COPY_READ_BUFFER, m_buf);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, dst_buf);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, m_slot * m_slot_size, dst_offset, size);
+
+	m_slot_fences[m_slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	m_slot = (m_slot + 1) % static_cast<int>(m_slot_fences.size());
+}
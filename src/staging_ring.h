@@ -0,0 +1,33 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <vector>
+
+#include "exception.h"
+
+// Upload ring in an immutable, persistently mapped buffer. The CPU writes
+// straight into the mapping and the data is copied into the destination
+// buffer on the GPU, each slot is fenced so it is only reused once the
+// copy reading it has completed.
+class staging_ring
+{
+public:
+	staging_ring();
+	~staging_ring();
+
+	void init(GLsizeiptr slot_size, int slot_count);
+
+	GLsizeiptr slot_size() const { return m_slot_size; }
+
+	// Returns the mapping of the next free slot, waits only if the GPU still reads it.
+	void* begin_write();
+	// Copy the first size bytes of the slot into dst_buf and release it to the GPU.
+	void end_write(GLuint dst_buf, GLintptr dst_offset, GLsizeiptr size);
+
+private:
+	GLuint m_buf;
+	GLubyte* m_mapping;
+	GLsizeiptr m_slot_size;
+	std::vector<GLsync> m_slot_fences;
+	int m_slot;
+};
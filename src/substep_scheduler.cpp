@@ -0,0 +1,68 @@
+#include "substep_scheduler.h"
+
+#include <algorithm>
+
+#include "exception.h"
+
+const int substep_scheduler::MAX_SUBSTEPS;
+
+
+substep_scheduler::substep_scheduler() :
+	m_sim_speed(1.0),
+	m_budget_ms(0.0),
+	m_accumulator(0.0),
+	m_max_substeps(4),
+	m_last_substeps(0)
+{
+}
+
+void substep_scheduler::set_max_substeps(int substeps)
+{
+	if (substeps < 1 || substeps > MAX_SUBSTEPS)
+		throw unrecoverable_except("Substeps must be between 1 and 64");
+
+	m_max_substeps = substeps;
+	m_budget_ms = 0.0;
+}
+
+void substep_scheduler::set_budget_ms(double budget_ms)
+{
+	if (budget_ms <= 0.0)
+		throw unrecoverable_except("Substep budget must be positive");
+
+	m_budget_ms = budget_ms;
+	m_max_substeps = 1;
+}
+
+int substep_scheduler::begin_frame(double wall_dt, double step_dt)
+{
+	m_accumulator += wall_dt * m_sim_speed;
+
+	int substeps = static_cast<int>(m_accumulator / step_dt);
+	if (substeps > m_max_substeps)
+	{
+		// Falling behind, drop the backlog rather than spiral into ever longer frames.
+		substeps = m_max_substeps;
+		m_accumulator = 0.0;
+	}
+	else
+		m_accumulator -= substeps * step_dt;
+
+	m_last_substeps = substeps;
+	return substeps;
+}
+
+void substep_scheduler::report_gpu_ms(double gpu_ms)
+{
+	if (!is_adaptive() || gpu_ms <= 0.0)
+		return;
+
+	// The reported frame may be a few frames old, so move the cap gently:
+	// grow by one step while under budget, scale down when well over it.
+	if (gpu_ms > m_budget_ms * 1.5)
+		m_max_substeps = std::max(1, static_cast<int>(m_max_substeps * m_budget_ms / gpu_ms));
+	else if (gpu_ms > m_budget_ms)
+		m_max_substeps = std::max(1, m_max_substeps - 1);
+	else if (gpu_ms < m_budget_ms * 0.8 && m_last_substeps == m_max_substeps)
+		m_max_substeps = std::min(MAX_SUBSTEPS, m_max_substeps + 1);
+}
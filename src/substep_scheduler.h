@@ -0,0 +1,36 @@
+#pragma once
+
+// Decides how many fixed size simulation steps to run per rendered frame.
+// Wall time is accumulated and paid out in whole steps, so the simulation
+// speed does not depend on the frame rate. The steps per frame are capped,
+// either at a fixed count or at a count adapted to a GPU time budget.
+class substep_scheduler
+{
+public:
+	static const int MAX_SUBSTEPS = 64;
+
+	substep_scheduler();
+
+	// Simulated seconds per wall second.
+	void set_sim_speed(double speed) { m_sim_speed = speed; }
+	// Fixed cap of steps per frame, disables the budget.
+	void set_max_substeps(int substeps);
+	// Adapt the cap so the simulation passes take about budget_ms of GPU time per frame.
+	void set_budget_ms(double budget_ms);
+
+	// Number of steps of step_dt simulated seconds to run this frame.
+	int begin_frame(double wall_dt, double step_dt);
+	// GPU time the simulation took in a recently finished frame, drives the adaptive cap.
+	void report_gpu_ms(double gpu_ms);
+
+	int max_substeps() const { return m_max_substeps; }
+	int last_substeps() const { return m_last_substeps; }
+	bool is_adaptive() const { return m_budget_ms > 0.0; }
+
+private:
+	double m_sim_speed;
+	double m_budget_ms;
+	double m_accumulator;	// simulated seconds owed to the simulation
+	int m_max_substeps;
+	int m_last_substeps;
+};
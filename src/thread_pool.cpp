@@ -0,0 +1,90 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+thread_pool::thread_pool(unsigned int threads) :
+	m_job(nullptr),
+	m_count(0),
+	m_chunk(1),
+	m_next(0),
+	m_generation(0),
+	m_running(0),
+	m_stop(false)
+{
+	if (threads == 0)
+		threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+	for (unsigned int i = 1; i < threads; i++)
+		m_workers.emplace_back(&thread_pool::worker_loop, this);
+}
+
+thread_pool::~thread_pool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_job_ready.notify_all();
+	for (std::thread& worker : m_workers)
+		worker.join();
+}
+
+void thread_pool::parallel_for(size_t count, const range_function& fn)
+{
+	if (count == 0)
+		return;
+
+	// A few chunks per thread evens out neighbourhoods of different density.
+	const size_t chunk = std::max<size_t>(count / (thread_count() * 8), 64);
+	if (m_workers.empty() || count <= chunk)
+	{
+		fn(0, count);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_job = &fn;
+		m_count = count;
+		m_chunk = chunk;
+		m_next = 0;
+		m_running = static_cast<unsigned int>(m_workers.size());
+		m_generation++;
+	}
+	m_job_ready.notify_all();
+
+	run_chunks();
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_job_done.wait(lock, [this] { return m_running == 0; });
+	m_job = nullptr;
+}
+
+void thread_pool::run_chunks()
+{
+	for (size_t begin = m_next.fetch_add(m_chunk); begin < m_count; begin = m_next.fetch_add(m_chunk))
+		(*m_job)(begin, std::min(begin + m_chunk, m_count));
+}
+
+void thread_pool::worker_loop()
+{
+	unsigned long generation = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_job_ready.wait(lock, [this, generation] { return m_stop || m_generation != generation; });
+			if (m_stop)
+				return;
+			generation = m_generation;
+		}
+
+		run_chunks();
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_running--;
+		}
+		m_job_done.notify_one();
+	}
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Worker threads that split index ranges between them and the calling thread.
+// One parallel_for() runs at a time, it returns once every index is done.
+class thread_pool
+{
+public:
+	typedef std::function<void(size_t begin, size_t end)> range_function;
+
+	// 0 threads uses one per hardware thread, the caller counts as one.
+	explicit thread_pool(unsigned int threads = 0);
+	~thread_pool();
+
+	thread_pool(const thread_pool&) = delete;
+	thread_pool& operator=(const thread_pool&) = delete;
+
+	unsigned int thread_count() const { return static_cast<unsigned int>(m_workers.size()) + 1; }
+
+	// Calls fn on consecutive chunks covering [0, count), from every thread.
+	void parallel_for(size_t count, const range_function& fn);
+
+private:
+	void worker_loop();
+	void run_chunks();
+
+	std::vector<std::thread> m_workers;
+	std::mutex m_mutex;
+	std::condition_variable m_job_ready;
+	std::condition_variable m_job_done;
+
+	// the current job, only changed while no worker is running it
+	const range_function* m_job;
+	size_t m_count;
+	size_t m_chunk;
+	std::atomic<size_t> m_next;
+	unsigned long m_generation;	// bumped for every job, workers wait for a new one
+	unsigned int m_running;		// workers still inside the current job
+	bool m_stop;
+};